@@ -0,0 +1,248 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* For rand_r */
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootstrap.h"
+#include "config.h"
+#include "kappa.h"
+#include "neemp.h"
+#include "parameters.h"
+#include "settings.h"
+#include "structures.h"
+#include "subset.h"
+
+extern const struct settings s;
+extern struct training_set ts;
+
+static void draw_resample(struct subset * const resample, const int * const pool, int pool_size, unsigned int * const seed);
+static int is_resample_fittable(const struct subset * const resample);
+static int compare_floats(const void *p1, const void *p2);
+static float percentile(const float * const sorted, int n, float p);
+static void print_row(FILE * const f, const char * const name, const char * const param, const float * const sorted);
+static void print_summary(FILE * const f, const float * const kappa, const float * const alpha, const float * const beta);
+
+/* Draw pool_size molecules from the pool with replacement; each one is weighted
+ * by the number of times it was drawn, the others are left out of the subset and
+ * so they are not solved by scan_kappa_for_subset() */
+static void draw_resample(struct subset * const resample, const int * const pool, int pool_size, unsigned int * const seed) {
+
+	assert(resample != NULL);
+	assert(resample->weights != NULL);
+	assert(pool != NULL);
+	assert(seed != NULL);
+
+	memset(resample->weights, 0x0, ts.molecules_count * sizeof(int));
+	b_clear_all(&resample->molecules);
+
+	for(int i = 0; i < pool_size; i++) {
+		const int mol_idx = pool[rand_r(seed) % pool_size];
+		resample->weights[mol_idx]++;
+		b_set(&resample->molecules, mol_idx);
+	}
+}
+
+/* Check whether calculate_parameters can fit every atom type of the resample */
+static int is_resample_fittable(const struct subset * const resample) {
+
+	assert(resample != NULL);
+	assert(resample->moments != NULL);
+
+	for(int i = 0; i < ts.atom_types_count; i++)
+		if(resample->moments[i].count < 2 || resample->moments[i].qq == 0.0)
+			return 0;
+
+	return 1;
+}
+
+/* Compare two floats via pointers */
+static int compare_floats(const void *p1, const void *p2) {
+
+	assert(p1 != NULL);
+	assert(p2 != NULL);
+
+	const float a = *(const float *) p1;
+	const float b = *(const float *) p2;
+
+	if(a > b)
+		return 1;
+	if(a < b)
+		return -1;
+
+	return 0;
+}
+
+/* Return p-th percentile of n sorted values, interpolated linearly between them */
+static float percentile(const float * const sorted, int n, float p) {
+
+	assert(sorted != NULL);
+
+	const float pos = p * (n - 1);
+	const int lo = (int) pos;
+	if(lo + 1 >= n)
+		return sorted[n - 1];
+
+	return sorted[lo] + (pos - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+/* Print mean, standard deviation and percentiles of one parameter over the resamples */
+static void print_row(FILE * const f, const char * const name, const char * const param, const float * const sorted) {
+
+	assert(f != NULL);
+	assert(name != NULL);
+	assert(param != NULL);
+	assert(sorted != NULL);
+
+	const int n = s.bootstrap;
+
+	double sum = 0.0;
+	for(int i = 0; i < n; i++)
+		sum += sorted[i];
+	const double mean = sum / n;
+
+	double sum2 = 0.0;
+	for(int i = 0; i < n; i++)
+		sum2 += (sorted[i] - mean) * (sorted[i] - mean);
+	const double stddev = n > 1 ? sqrt(sum2 / (n - 1)) : 0.0;
+
+	fprintf(f, " %-10s %s\t%8.4f %8.4f %8.4f %8.4f %8.4f\n", name, param, mean, stddev,
+		percentile(sorted, n, 0.025f), percentile(sorted, n, 0.5f), percentile(sorted, n, 0.975f));
+}
+
+/* Print the bootstrap summary of all the parameters */
+static void print_summary(FILE * const f, const float * const kappa, const float * const alpha, const float * const beta) {
+
+	assert(f != NULL);
+	assert(kappa != NULL);
+	assert(alpha != NULL);
+	assert(beta != NULL);
+
+	fprintf(f, "Bootstrap of the parameters over %d resamples:\n", s.bootstrap);
+	fprintf(f, "Parameter\t    Mean   Stddev     2.5%%      50%%    97.5%%\n");
+	print_row(f, "Kappa", " ", kappa);
+	for(int i = 0; i < ts.atom_types_count; i++) {
+		char buff[10];
+		at_format_text(&ts.atom_types[i], buff);
+		print_row(f, buff, "A", alpha + i * s.bootstrap);
+		print_row(f, buff, "B", beta + i * s.bootstrap);
+	}
+}
+
+/* Fit the parameters on s.bootstrap resamples of the molecules of ss concurrently and
+ * report their distribution; the output file is placed next to --par-out-file */
+void run_bootstrap(const struct subset * const ss) {
+
+	assert(ss != NULL);
+
+	const int n = s.bootstrap;
+
+	int pool_size = 0;
+	int *pool = (int *) malloc(ts.molecules_count * sizeof(int));
+	unsigned int *seeds = (unsigned int *) malloc(n * sizeof(unsigned int));
+	float *kappa = (float *) malloc(n * sizeof(float));
+	float *alpha = (float *) malloc(n * ts.atom_types_count * sizeof(float));
+	float *beta = (float *) malloc(n * ts.atom_types_count * sizeof(float));
+	if(!pool || !seeds || !kappa || !alpha || !beta)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for bootstrap.\n");
+
+	for(int i = 0; i < ts.molecules_count; i++)
+		if(b_get(&ss->molecules, i))
+			pool[pool_size++] = i;
+
+	/* Each resample gets its own random stream so the results don't depend on the threads */
+	for(int r = 0; r < n; r++)
+		seeds[r] = (unsigned int) rand();
+
+	/* Each resample is fitted by one thread, the nested parallel regions run serially */
+	const int nthreads = n < s.max_threads ? n : s.max_threads;
+
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+	for(int r = 0; r < n; r++) {
+		struct subset resample;
+		resample.kappa_data_count = 0;
+		resample.data = NULL;
+		ss_init(&resample, NULL);
+
+		resample.weights = (int *) malloc(ts.molecules_count * sizeof(int));
+		if(!resample.weights)
+			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for bootstrap.\n");
+
+		int attempts = 0;
+		do {
+			if(attempts++ == MAX_RESAMPLE_ATTEMPTS)
+				EXIT_ERROR(RUN_ERROR, "%s", "Cannot draw a bootstrap resample with enough atoms of each atom type.\n");
+
+			draw_resample(&resample, pool, pool_size, &seeds[r]);
+			calculate_moments(&resample);
+		} while(!is_resample_fittable(&resample));
+
+		struct kappa_data best;
+		kd_init(&best);
+
+		/* With kappa given, the statistics are not needed to choose it */
+		if(s.kappa_set > 1e-10) {
+			best.kappa = s.kappa_set;
+			calculate_parameters(&resample, &best);
+		}
+		else
+			scan_kappa_for_subset(&resample, &best);
+
+		kappa[r] = best.kappa;
+		for(int i = 0; i < ts.atom_types_count; i++) {
+			alpha[i * n + r] = best.parameters_alpha[i];
+			beta[i * n + r] = best.parameters_beta[i];
+		}
+
+		kd_destroy(&best);
+		ss_destroy(&resample);
+	}
+
+	qsort(kappa, n, sizeof(float), compare_floats);
+	for(int i = 0; i < ts.atom_types_count; i++) {
+		qsort(alpha + i * n, n, sizeof(float), compare_floats);
+		qsort(beta + i * n, n, sizeof(float), compare_floats);
+	}
+
+	printf("\n");
+	print_summary(stdout, kappa, alpha, beta);
+
+	if(s.par_out_file[0] != '\0') {
+		char filename[MAX_PATH_LEN + 16];
+		snprintf(filename, MAX_PATH_LEN + 16, "%s.bootstrap", s.par_out_file);
+
+		FILE * const f = fopen(filename, "w");
+		if(!f)
+			EXIT_ERROR(IO_ERROR, "Cannot open file %s for writing the bootstrap summary.\n", filename);
+
+		print_summary(f, kappa, alpha, beta);
+		fclose(f);
+	}
+
+	free(pool);
+	free(seeds);
+	free(kappa);
+	free(alpha);
+	free(beta);
+}
@@ -39,4 +39,18 @@
 
 #define WARN_MIN_RCOND 0.000005F
 
+/* Maximum number of iterative refinement steps for --mixed-precision */
+#define MAX_REFINEMENT_STEPS 5
+
+/* Block size the work array of --eem-solver full is sized for */
+#define FULL_SOLVER_BLOCK 64
+
+/* Atom type moments are updated incrementally by discarding at most this many
+ * times in a row before they are recalculated from scratch */
+#define MAX_MOMENTS_UPDATES 100
+
+/* Bootstrap resample is drawn again at most this many times if some atom type
+ * ends up with too few distinct atoms to fit its parameters */
+#define MAX_RESAMPLE_ATTEMPTS 100
+
 #endif /* __CONFIG_H__ */
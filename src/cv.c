@@ -0,0 +1,173 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cv.h"
+#include "eem.h"
+#include "kappa.h"
+#include "neemp.h"
+#include "parameters.h"
+#include "settings.h"
+#include "statistics.h"
+#include "structures.h"
+#include "subset.h"
+
+extern const struct settings s;
+extern struct training_set ts;
+
+static void assign_folds(int * const fold_of);
+static void fit_fold(struct subset * const train, struct kappa_data * const best);
+
+/* Assign molecules to folds at random so that fold sizes differ by one at most */
+static void assign_folds(int * const fold_of) {
+
+	assert(fold_of != NULL);
+
+	int *order = (int *) malloc(ts.molecules_count * sizeof(int));
+	if(!order)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for cross-validation.\n");
+
+	for(int i = 0; i < ts.molecules_count; i++)
+		order[i] = i;
+
+	for(int i = ts.molecules_count - 1; i > 0; i--) {
+		const int j = rand() % (i + 1);
+		const int tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	for(int i = 0; i < ts.molecules_count; i++)
+		fold_of[order[i]] = i % s.cv_folds;
+
+	free(order);
+}
+
+/* Fit the parameters on the training molecules only; best gets the best kappa_data found */
+static void fit_fold(struct subset * const train, struct kappa_data * const best) {
+
+	assert(train != NULL);
+	assert(best != NULL);
+
+	calculate_moments(train);
+	for(int i = 0; i < ts.atom_types_count; i++)
+		if(train->moments[i].count < 2) {
+			char buff[10];
+			at_format_text(&ts.atom_types[i], buff);
+			EXIT_ERROR(RUN_ERROR, "Too few atoms of type %s left for the fit in one of the folds. Use fewer folds.\n", buff);
+		}
+
+	scan_kappa_for_subset(train, best);
+}
+
+/* Perform k-fold cross-validation: fit the parameters without each fold and
+ * validate them on it; folds are processed concurrently */
+void run_cross_validation(void) {
+
+	const int folds = s.cv_folds;
+	if(folds > ts.molecules_count)
+		EXIT_ERROR(RUN_ERROR, "Cannot split %d molecules into %d folds.\n", ts.molecules_count, folds);
+
+	int *fold_of = (int *) malloc(ts.molecules_count * sizeof(int));
+	struct subset *train = (struct subset *) calloc(folds, sizeof(struct subset));
+	struct subset *validation = (struct subset *) calloc(folds, sizeof(struct subset));
+	struct kappa_data *fitted = (struct kappa_data *) calloc(folds, sizeof(struct kappa_data));
+	struct kappa_data *validated = (struct kappa_data *) calloc(folds, sizeof(struct kappa_data));
+	if(!fold_of || !train || !validation || !fitted || !validated)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for cross-validation.\n");
+
+	assign_folds(fold_of);
+
+	for(int f = 0; f < folds; f++) {
+		ss_init(&train[f], NULL);
+		ss_init(&validation[f], NULL);
+		b_clear_all(&validation[f].molecules);
+
+		for(int i = 0; i < ts.molecules_count; i++)
+			if(fold_of[i] == f) {
+				b_clear(&train[f].molecules, i);
+				b_set(&validation[f].molecules, i);
+			}
+
+		kd_init(&fitted[f]);
+		kd_init(&validated[f]);
+	}
+
+	/* Each fold is fitted by one thread, the nested parallel regions run serially */
+	const int nthreads = folds < s.max_threads ? folds : s.max_threads;
+
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+	for(int f = 0; f < folds; f++) {
+		fit_fold(&train[f], &fitted[f]);
+
+		/* Only the training molecules were solved during the fit */
+		kd_copy(&fitted[f], &validated[f]);
+		calculate_charges_for_subset(&validation[f], &validated[f]);
+		calculate_statistics_for_subset(&validation[f], &validated[f]);
+	}
+
+	printf("\nCross-validation results:\n");
+
+	struct kappa_data average;
+	kd_init(&average);
+	average.kappa = 0.0f;
+	average.full_stats = (struct stats) {0};
+
+	for(int f = 0; f < folds; f++) {
+		printf("\nFold %d. Training molecules: %d Validation molecules: %d\n", f + 1,
+		       b_count_bits(&train[f].molecules), b_count_bits(&validation[f].molecules));
+		printf("Training:   ");
+		kd_print_stats(&fitted[f]);
+		printf("Validation: ");
+		kd_print_stats(&validated[f]);
+
+		if(s.verbosity >= VERBOSE_KAPPA)
+			kd_print_results(&fitted[f]);
+
+		#define STATS validated[f].full_stats
+		average.kappa += fitted[f].kappa / folds;
+		average.full_stats.R += STATS.R / folds;
+		average.full_stats.R2 += STATS.R2 / folds;
+		average.full_stats.R_w += STATS.R_w / folds;
+		average.full_stats.spearman += STATS.spearman / folds;
+		average.full_stats.RMSD += STATS.RMSD / folds;
+		average.full_stats.D_avg += STATS.D_avg / folds;
+		average.full_stats.D_max += STATS.D_max / folds;
+		#undef STATS
+	}
+
+	printf("\nAverage validation statistics over %d folds:\n", folds);
+	kd_print_stats(&average);
+
+	kd_destroy(&average);
+	for(int f = 0; f < folds; f++) {
+		kd_destroy(&fitted[f]);
+		kd_destroy(&validated[f]);
+		ss_destroy(&train[f]);
+		ss_destroy(&validation[f]);
+	}
+
+	free(fold_of);
+	free(train);
+	free(validation);
+	free(fitted);
+	free(validated);
+}
@@ -177,8 +177,7 @@ void run_diff_evolution(struct subset * const ss) {
 						printf("\nDE min thread %d\n", omp_get_thread_num());
 
 					/* Copy trial into private structure */
-					struct kappa_data *min_trial = (struct kappa_data *) malloc(sizeof(struct kappa_data));
-					kd_init(min_trial);
+					struct kappa_data *min_trial = kd_acquire();
 					min_trial->parent_subset = ss;
 
 					#pragma omp critical
@@ -201,8 +200,7 @@ void run_diff_evolution(struct subset * const ss) {
 								kd_print_results(so_far_best);
 							}
 						}
-					kd_destroy(min_trial);
-					free(min_trial);
+					kd_release(min_trial);
 				}
 			}
 		}
@@ -279,14 +277,12 @@ int minimize_part_of_population(struct subset * ss, int *good_indices) {
 				good_indices[quite_good] = i;
 				quite_good++;
 			}
-			struct kappa_data* m = (struct kappa_data *) malloc (sizeof(struct kappa_data));
-			kd_init(m);
+			struct kappa_data* m = kd_acquire();
 			m->parent_subset = ss;
 			kd_copy_parameters(&ss->data[i], m);
 			minimize_locally(m, 1000);
 			kd_copy_parameters(m, &ss->data[i]);
-			kd_destroy(m);
-			free(m);
+			kd_release(m);
 
 		}
 	}
@@ -389,8 +385,7 @@ extern void calfun_(int n, double *x, double *f) {
 	assert(x != NULL);
 	assert(f != NULL);
 
-	struct kappa_data *t = (struct kappa_data *) malloc (sizeof(struct kappa_data));
-	kd_init(t);
+	struct kappa_data *t = kd_acquire();
 	double_array_to_kappa_data(x, t);
 	calculate_charges(de_ss, t);
 	calculate_statistics_by_sort_mode(t);
@@ -405,8 +400,7 @@ extern void calfun_(int n, double *x, double *f) {
 		default:
 			*f = (double) (result) + n -n;
 	}
-	kd_destroy(t);
-	free(t);
+	kd_release(t);
 }
 
 /* Convert kappa_data into an array of doubles, used in local minimization */
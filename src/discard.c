@@ -23,6 +23,7 @@
 #include "discard.h"
 #include "kappa.h"
 #include "limits.h"
+#include "parameters.h"
 #include "settings.h"
 #include "subset.h"
 #include "structures.h"
@@ -61,6 +62,7 @@ struct subset *discard_iterative(const struct subset * const initial) {
 		t_update(&ban_list, mol_idx);
 
 		b_flip(&current->molecules, mol_idx);
+		update_moments(current, mol_idx);
 
 		if(s.verbosity >= VERBOSE_DISCARD) {
 			fprintf(stdout, "\nIteration no. %d. Molecule: %s Molecules used: %d\n",\
@@ -119,6 +121,7 @@ struct subset *discard_simple(const struct subset * const initial) {
 
 		/* Flip i-th molecule from the parent */
 		b_flip(&current->molecules, i);
+		update_moments(current, i);
 
 		if(s.verbosity >= VERBOSE_DISCARD) {
 			fprintf(stdout, "\nIteration no. %d. Molecule: %s Molecules used: %d\n",\
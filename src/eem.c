@@ -19,8 +19,10 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include <assert.h>
+#include <float.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <omp.h>
 
 #ifdef USE_MKL
@@ -28,19 +30,167 @@
 #else
 extern void dspsvx_(char *fact, char *uplo, int *n, int *nrhs, const double *ap, double *afp, int *ipiv, const double *b, int *ldb, double *x, int *ldx, double *rcond, double *ferr, double *berr, double *work, int *iwork, int *info);
 extern void dspsv_(char *uplo, int *n, int *nrhs, double *ap, int *ipiv, double *b, int *ldb, int *info);
+extern void dsysv_(char *uplo, int *n, int *nrhs, double *a, int *lda, int *ipiv, double *b, int *ldb, double *work, int *lwork, int *info);
+extern void ssptrf_(char *uplo, int *n, float *ap, int *ipiv, int *info);
+extern void ssptrs_(char *uplo, int *n, int *nrhs, const float *ap, const int *ipiv, float *b, int *ldb, int *info);
 #endif /* USE_MKL */
 
 #include "eem.h"
+#include "fragments.h"
+#include "krylov.h"
 #include "neemp.h"
+#include "neighbours.h"
+#include "rdists.h"
 #include "settings.h"
+#include "smallsolve.h"
+#include "spill.h"
+#include "treecode.h"
+#include "tuning.h"
 #include "subset.h"
 #include "structures.h"
 
 extern const struct training_set ts;
 extern const struct settings s;
 
+/* Per-thread buffers for solving EEM systems; allocated once for the largest
+ * molecule and reused across calls until eem_destroy_workspaces() */
+struct eem_workspace {
+
+	int atoms_max;
+
+	double *Ap;
+	double *Afp;
+	double *b;
+	double *x;
+	double *work;
+
+	int *ipiv;
+	int *iwork;
+
+	/* Work vectors and preconditioner of the iterative solver */
+	double *krylov;
+
+	/* Single precision copy of the matrix and right-hand side for --mixed-precision */
+	float *Asp;
+	float *bsp;
+
+	/* Full storage system for the fixed-size kernels */
+	double *As;
+	double *bs;
+
+	/* Interleaved systems for --batched-solve */
+	double *Ab;
+	double *bb;
+
+	/* Full storage copy of the matrix and work array of the blocked solver;
+	 * allocated on the first use */
+	double *Af;
+	double *fwork;
+};
+
+/* Solver of the EEM system stored in the workspace. Return 0 on success and
+ * point solution to the charges. Only the packed solver overwrites the system. */
+typedef int (*eem_backend)(struct eem_workspace * const ws, int n, const float * const guess, double sum_of_charges,
+			   int * const iters, const double ** const solution);
+
+enum backend_idx {
+
+	BACKEND_SMALL,
+	BACKEND_PACKED,
+	BACKEND_FULL,
+	BACKEND_MINRES,
+	BACKENDS_COUNT
+};
+
+struct solver_backend {
+
+	const char *name;
+	eem_backend solve;
+
+	/* Largest system the backend can solve; 0 if there is no limit */
+	int max_size;
+};
+
+/* EEM system in packed storage as seen by the iterative solver */
+struct packed_system {
+
+	const double *Ap;
+	int n;
+};
+
+/* EEM system with kappa/r interactions evaluated by the treecode */
+struct treecode_system {
+
+	struct treecode *tc;
+	const double *diag;
+	double *phi;
+	double kappa;
+	int nthreads;
+};
+
+/* EEM system with shifted kappa/r interactions limited by the cutoff */
+struct cutoff_system {
+
+	const struct neighbour_list *nl;
+	const double *diag;
+	double kappa;
+};
+
+static struct eem_workspace *workspace = NULL;
+#pragma omp threadprivate(workspace)
+
+/* List of all workspaces created by any thread */
+static struct eem_workspace **workspaces = NULL;
+static int workspaces_count = 0;
+
+static int backend_small(struct eem_workspace * const ws, int n, const float * const guess, double sum_of_charges,
+			 int * const iters, const double ** const solution);
+static int backend_packed(struct eem_workspace * const ws, int n, const float * const guess, double sum_of_charges,
+			  int * const iters, const double ** const solution);
+static int backend_full(struct eem_workspace * const ws, int n, const float * const guess, double sum_of_charges,
+			int * const iters, const double ** const solution);
+static int backend_minres(struct eem_workspace * const ws, int n, const float * const guess, double sum_of_charges,
+			  int * const iters, const double ** const solution);
+
+static const struct solver_backend backends[BACKENDS_COUNT] = {
+	{"small", backend_small, SMALL_SOLVER_MAX_SIZE},
+	{"packed", backend_packed, 0},
+	{"full", backend_full, 0},
+	{"minres", backend_minres, 0}
+};
+
+/* Backend used for each band of system sizes by --eem-solver auto */
+static int band_backends[TUNING_BANDS_COUNT];
+
 static int check_matrix_packed(const double * const A, const int n);
-static void fill_EEM_matrix_packed(double * const A, const struct molecule * const m, const struct kappa_data * const kd);
+static void fill_EEM_matrix_atoms(double * const A, int n, const float * const x, const float * const y, const float * const z,
+				  const int * const types, const rdist_t * const rdists, const struct kappa_data * const kd);
+static void fill_EEM_matrix_packed(double * const A, int i, const struct kappa_data * const kd);
+static struct eem_workspace *get_workspace(int n);
+static void ws_free_contents(struct eem_workspace * const ws);
+static void matvec_packed(const void * const ctx, const double * const x, double * const y);
+static int solve_eem_minres(int n, krylov_matvec matvec, const void * const ctx, const double * const diag, const double * const b,
+			    const float * const guess, double sum_of_charges, double * const x, double * const work, int * const iters);
+static int solve_minres(struct eem_workspace * const ws, int n, const float * const guess, double sum_of_charges, int * const iters);
+static void matvec_cutoff(const void * const ctx, const double * const x, double * const y);
+static void calculate_charges_cutoff(struct kappa_data * const kd, const int * const starts, int nthreads);
+static void eem_preconditioner(int n, const double * const diag, double * const minv);
+static void eem_initial_guess(int n, krylov_matvec matvec, const void * const ctx, const double * const b,
+			      const float * const guess, double sum_of_charges, double * const x, double * const y);
+static void matvec_treecode(const void * const ctx, const double * const x, double * const y);
+static int solve_dense(int i, const struct kappa_data * const kd, double * const q);
+static void print_dense_difference(const char * const method, int i, const struct kappa_data * const kd, const float * const charges);
+static void calculate_charges_treecode(struct kappa_data * const kd, const int * const starts, int nthreads);
+static int solve_fragment(int i, const struct fragments * const fr, int f, const struct kappa_data * const kd,
+			  float * const pos, int * const types, float * const charges);
+static void calculate_charges_fragments(struct kappa_data * const kd, const int * const starts, int nthreads);
+static int solve_mixed_precision(struct eem_workspace * const ws, int n);
+static int solve_small(struct eem_workspace * const ws, int n, int size);
+static int is_solution_accurate(const double * const Ap, const double * const b, const double * const x, int nn, double * const r);
+static void fill_tuning_system(double * const Ap, double * const b, int n);
+static int measure_fastest_backend(int n);
+static int compare_atoms_count(const void *p1, const void *p2);
+static int *calculate_charges_batched(struct kappa_data * const kd, const int * const starts, int nthreads);
 
 #ifdef NOT_USED
 static void print_matrix_packed(const double * const A, long int n);
@@ -80,38 +230,59 @@ static void print_matrix_full(const double * const A, long int n) {
 
 #endif /* NOT_USED */
 
-/* Use packed storage scheme to fill EEM matrix */
-static void fill_EEM_matrix_packed(double * const A, const struct molecule * const m, const struct kappa_data * const kd) {
+/* Use packed storage scheme to fill EEM matrix of n atoms given by their coordinates
+ * and atom type indices; rdists are their cached reciprocal distances or NULL */
+static void fill_EEM_matrix_atoms(double * const A, int n, const float * const x, const float * const y, const float * const z,
+				  const int * const types, const rdist_t * const rdists, const struct kappa_data * const kd) {
 
 	assert(A != NULL);
-	assert(m != NULL);
+	assert(x != NULL && y != NULL && z != NULL);
+	assert(types != NULL);
 	assert(kd != NULL);
 
-	const long int n = m->atoms_count;
-
 	/* Following #define works only for i <= j */
 	#define U_IDX(x, y) (x + (y * (y + 1))/2)
 
-	/* Fill the upper half of the n * n block */
-	for(long int i = 0; i < n; i++) {
-		A[U_IDX(i, i)] = kd->parameters_beta[get_atom_type_idx(&m->atoms[i])];
-		for(long int j = i + 1; j < n; j++) {
-			if(s.mode == MODE_PARAMS)
-				A[U_IDX(i, j)] = kd->kappa * m->atoms[i].rdists[j];
-			else
-				A[U_IDX(i, j)] = kd->kappa * rdist(&m->atoms[i], &m->atoms[j]);
-		}
+	/* Fill the upper half of the n * n block by columns; cached reciprocal distances
+	 * are read from the arena in the same order, others are computed on the fly */
+	for(long int j = 0; j < n; j++) {
+		if(rdists != NULL)
+			for(long int i = 0; i < j; i++)
+				A[U_IDX(i, j)] = kd->kappa * rdists[RDIST_IDX(i, j)];
+		else
+			rd_column(x, y, z, j, kd->kappa, A + U_IDX(0, j));
+
+		A[U_IDX(j, j)] = kd->parameters_beta[types[j]];
 	}
 
 	/* Fill last column */
 	for(long int i = 0; i < n; i++)
-		A[U_IDX(i, n)] = 1.0f;
+		A[U_IDX(i, (long int) n)] = 1.0f;
 
 	/* Set the bottom right element to zero */
-	A[U_IDX(n, n)] = 0.0f;
+	A[U_IDX((long int) n, (long int) n)] = 0.0f;
 	#undef U_IDX
 }
 
+/* Use packed storage scheme to fill EEM matrix of the i-th molecule */
+static void fill_EEM_matrix_packed(double * const A, int i, const struct kappa_data * const kd) {
+
+	assert(A != NULL);
+	assert(kd != NULL);
+
+	const int start = ts.molecule_starts[i];
+	const rdist_t * const rdists = (s.mode == MODE_PARAMS || s.mode == MODE_CV) && ts.molecules[i].rdists_offset >= 0 ?
+				       ts.rdists + ts.molecules[i].rdists_offset : NULL;
+
+	/* Molecules are solved roughly in order, so request the next chunk from the
+	 * spill file one chunk ahead */
+	if(s.spill_file[0] != '\0' && i % SPILL_READAHEAD_MOLECULES == 0)
+		spill_readahead(i == 0 ? 0 : i + SPILL_READAHEAD_MOLECULES, i + 2 * SPILL_READAHEAD_MOLECULES);
+
+	fill_EEM_matrix_atoms(A, ts.molecules[i].atoms_count, ts.pos_x + start, ts.pos_y + start, ts.pos_z + start,
+			      ts.atom_type_idx + start, rdists, kd);
+}
+
 /* Check if matrix contains some NaN or Inf values */
 static int check_matrix_packed(const double * const A, const int n) {
 
@@ -124,134 +295,1367 @@ static int check_matrix_packed(const double * const A, const int n) {
 	return 0;
 }
 
-/* Calculate charges for a particular kappa_data structure */
-void calculate_charges(struct subset * const ss, struct kappa_data * const kd) {
+/* Return workspace of the calling thread large enough for a system of n atoms */
+static struct eem_workspace *get_workspace(int n) {
 
-	assert(ss != NULL);
-	assert(kd != NULL);
+	if(workspace != NULL && workspace->atoms_max >= n)
+		return workspace;
 
-	/* Compute starting indices for storing the charges of each molecule. These are
-	 * needed to guarantee the independence of the for loop iterations */
-	int starts[ts.molecules_count];
-	starts[0] = 0;
-	for(int i = 1; i < ts.molecules_count; i++)
-		starts[i] = starts[i - 1] + ts.molecules[i - 1].atoms_count;
-	int nt = s.max_threads;
-	if (s.params_method == PARAMS_DE || s.params_method == PARAMS_GM)
-		nt /= s.om_threads;
+	if(workspace == NULL) {
+		workspace = (struct eem_workspace *) calloc(1, sizeof(struct eem_workspace));
+		if(!workspace)
+			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM workspace.\n");
 
-	int nthreads = ts.molecules_count < nt ? ts.molecules_count : nt;
-	#pragma omp parallel for num_threads(nthreads)
+		/* Remember the workspace so that it can be freed at the end */
+		#pragma omp critical (eem_workspaces)
+		{
+			workspaces = (struct eem_workspace **) realloc(workspaces, (workspaces_count + 1) * sizeof(struct eem_workspace *));
+			if(!workspaces)
+				EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM workspace.\n");
+
+			workspaces[workspaces_count++] = workspace;
+		}
+	} else
+		ws_free_contents(workspace);
+
+	/* Size the workspace for the largest molecule so it is allocated only once;
+	 * with fragments, the systems are much smaller than the molecules */
+	int atoms_max = n;
+	if(s.fragment_size == 0.0f)
+		for(int i = 0; i < ts.molecules_count; i++)
+			if(ts.molecules[i].atoms_count > atoms_max)
+				atoms_max = ts.molecules[i].atoms_count;
+
+	const long int nn = atoms_max + 1;
+	const long int packed = (nn * (nn + 1)) / 2;
+
+	/* The cutoff and treecode solvers never build the dense matrix */
+	const int dense = s.cutoff == 0.0f && s.treecode_theta < 0.0f;
+
+	void *tmp1 = NULL, *tmp2 = NULL, *tmp3 = NULL, *tmp4 = NULL, *tmp5 = NULL;
+	if(dense)
+		posix_memalign(&tmp1, 64, packed * sizeof(double));
+	posix_memalign(&tmp2, 64, nn * sizeof(double));
+	posix_memalign(&tmp3, 64, nn * sizeof(double));
+	posix_memalign(&tmp4, 64, 3 * nn * sizeof(double));
+	posix_memalign(&tmp5, 64, 2 * nn * sizeof(int));
+	workspace->Ap = (double *) tmp1;
+	workspace->b = (double *) tmp2;
+	workspace->x = (double *) tmp3;
+	workspace->work = (double *) tmp4;
+	workspace->ipiv = (int *) tmp5;
+	workspace->iwork = workspace->ipiv + nn;
+
+	/* Factorized matrix is needed only for the expert driver */
+	if(s.extra_precise) {
+		void *tmp6 = NULL;
+		posix_memalign(&tmp6, 64, packed * sizeof(double));
+		workspace->Afp = (double *) tmp6;
+	}
+
+	long int krylov_size = 0;
+	if(s.eem_solver == SOLVER_MINRES || s.eem_solver == SOLVER_AUTO || s.cutoff > 0.0f)
+		krylov_size = MINRES_WORK_SIZE(nn) + nn;
+	if(s.treecode_theta >= 0.0f)
+		krylov_size = GMRES_WORK_SIZE(nn, TREECODE_GMRES_RESTART) + nn;
+
+	if(krylov_size > 0) {
+		void *tmp8 = NULL;
+		posix_memalign(&tmp8, 64, krylov_size * sizeof(double));
+		workspace->krylov = (double *) tmp8;
+	}
+
+	if(s.mixed_precision) {
+		void *tmp9 = NULL, *tmp10 = NULL;
+		posix_memalign(&tmp9, 64, packed * sizeof(float));
+		posix_memalign(&tmp10, 64, nn * sizeof(float));
+		workspace->Asp = (float *) tmp9;
+		workspace->bsp = (float *) tmp10;
+	}
+
+	/* Fixed-size kernels are used by the default direct solver */
+	const int small_size = small_solver_size(nn < SMALL_SOLVER_MAX_SIZE ? nn : SMALL_SOLVER_MAX_SIZE);
+	if(!s.extra_precise && !s.mixed_precision) {
+		void *tmp11 = NULL, *tmp12 = NULL;
+		posix_memalign(&tmp11, 64, small_size * small_size * sizeof(double));
+		posix_memalign(&tmp12, 64, small_size * sizeof(double));
+		workspace->As = (double *) tmp11;
+		workspace->bs = (double *) tmp12;
+	}
+
+	if(s.batched_solve) {
+		const long int batch_size = nn < SMALL_SOLVER_MAX_SIZE ? nn : SMALL_SOLVER_MAX_SIZE;
+		void *tmp13 = NULL, *tmp14 = NULL;
+		posix_memalign(&tmp13, 64, batch_size * batch_size * BATCH_WIDTH * sizeof(double));
+		posix_memalign(&tmp14, 64, batch_size * BATCH_WIDTH * sizeof(double));
+		workspace->Ab = (double *) tmp13;
+		workspace->bb = (double *) tmp14;
+	}
+
+	if((dense && !workspace->Ap) || !workspace->b || !workspace->x || !workspace->work || !workspace->ipiv ||
+	   (s.extra_precise && !workspace->Afp) || (krylov_size > 0 && !workspace->krylov) ||
+	   (s.mixed_precision && (!workspace->Asp || !workspace->bsp)) ||
+	   (!s.extra_precise && !s.mixed_precision && (!workspace->As || !workspace->bs)) ||
+	   (s.batched_solve && (!workspace->Ab || !workspace->bb)))
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM system.\n");
+
+	workspace->atoms_max = atoms_max;
+
+	return workspace;
+}
+
+/* Free arrays held by the workspace */
+static void ws_free_contents(struct eem_workspace * const ws) {
+
+	assert(ws != NULL);
+
+	free(ws->Ap);
+	free(ws->Afp);
+	free(ws->b);
+	free(ws->x);
+	free(ws->work);
+	free(ws->ipiv);
+	free(ws->krylov);
+	free(ws->Asp);
+	free(ws->bsp);
+	free(ws->As);
+	free(ws->bs);
+	free(ws->Ab);
+	free(ws->bb);
+	free(ws->Af);
+	free(ws->fwork);
+
+	ws->Ap = ws->Afp = ws->b = ws->x = ws->work = ws->krylov = NULL;
+	ws->Asp = ws->bsp = NULL;
+	ws->As = ws->bs = NULL;
+	ws->Ab = ws->bb = NULL;
+	ws->Af = ws->fwork = NULL;
+	ws->ipiv = ws->iwork = NULL;
+	ws->atoms_max = 0;
+}
+
+/* Free workspaces of all threads */
+void eem_destroy_workspaces(void) {
+
+	for(int i = 0; i < workspaces_count; i++) {
+		ws_free_contents(workspaces[i]);
+		free(workspaces[i]);
+	}
+
+	free(workspaces);
+	workspaces = NULL;
+	workspaces_count = 0;
+}
+
+/* Multiply vector by the symmetric matrix stored in packed format */
+static void matvec_packed(const void * const ctx, const double * const x, double * const y) {
+
+	assert(ctx != NULL);
+
+	const struct packed_system * const sys = (const struct packed_system *) ctx;
+	const int n = sys->n;
+
+	for(int i = 0; i < n; i++)
+		y[i] = 0.0;
+
+	for(long int j = 0; j < n; j++) {
+		const double * const col = sys->Ap + (j * (j + 1)) / 2;
+		const double xj = x[j];
+		double sum = 0.0;
+		for(long int i = 0; i < j; i++) {
+			y[i] += col[i] * xj;
+			sum += col[i] * x[i];
+		}
+		y[j] += sum + col[j] * xj;
+	}
+}
+
+/* Fill inverse of the diagonal preconditioner for EEM system of n atoms: Jacobi for
+ * the atom block, the constraint row uses the diagonal of the approximate Schur
+ * complement. diag holds the diagonal of the atom block and may alias minv. */
+static void eem_preconditioner(int n, const double * const diag, double * const minv) {
+
+	assert(diag != NULL);
+	assert(minv != NULL);
+
+	double schur = 0.0;
+	for(int j = 0; j < n; j++) {
+		const double d = fabs(diag[j]);
+		minv[j] = d > 0.0 ? 1.0 / d : 1.0;
+		schur += minv[j];
+	}
+	minv[n] = 1.0 / schur;
+}
+
+/* Set x to the initial guess for EEM system of n atoms: charges from guess shifted
+ * to the right total charge and the electronegativity which fits them best in the
+ * least-squares sense; y is a temporary vector */
+static void eem_initial_guess(int n, krylov_matvec matvec, const void * const ctx, const double * const b,
+			      const float * const guess, double sum_of_charges, double * const x, double * const y) {
+
+	assert(matvec != NULL);
+	assert(b != NULL);
+	assert(guess != NULL);
+	assert(x != NULL);
+	assert(y != NULL);
+
+	double sum = 0.0;
+	for(int j = 0; j < n; j++) {
+		x[j] = isfinite(guess[j]) ? guess[j] : 0.0;
+		sum += x[j];
+	}
+
+	for(int j = 0; j < n; j++)
+		x[j] += (sum_of_charges - sum) / n;
+	x[n] = 0.0;
+
+	matvec(ctx, x, y);
+	double chi = 0.0;
+	for(int j = 0; j < n; j++)
+		chi += b[j] - y[j];
+	x[n] = chi / n;
+}
+
+/* Solve EEM system of n atoms given by matvec by MINRES starting from the charges
+ * in guess. The work array has MINRES_WORK_SIZE(n + 1) + n + 1 elements; diag holds
+ * the diagonal of the atom block and may point to the tail of work. Return 0 on
+ * convergence. */
+static int solve_eem_minres(int n, krylov_matvec matvec, const void * const ctx, const double * const diag, const double * const b,
+			    const float * const guess, double sum_of_charges, double * const x, double * const work, int * const iters) {
+
+	assert(iters != NULL);
+
+	const int nn = n + 1;
+	double * const minv = work + MINRES_WORK_SIZE(nn);
+
+	eem_preconditioner(n, diag, minv);
+	eem_initial_guess(n, matvec, ctx, b, guess, sum_of_charges, x, work);
+
+	return minres(nn, matvec, ctx, b, x, minv, s.solver_tolerance, s.solver_max_iters, iters, work);
+}
+
+/* Solve EEM system stored in the workspace by MINRES starting from the charges
+ * in guess; the solution is left in ws->x. Return 0 on convergence. */
+static int solve_minres(struct eem_workspace * const ws, int n, const float * const guess, double sum_of_charges, int * const iters) {
+
+	assert(ws != NULL);
+
+	const int nn = n + 1;
+	const struct packed_system sys = {ws->Ap, nn};
+	double * const diag = ws->krylov + MINRES_WORK_SIZE(nn);
+
+	for(long int j = 0; j < n; j++)
+		diag[j] = ws->Ap[j + (j * (j + 1)) / 2];
+
+	return solve_eem_minres(n, matvec_packed, &sys, diag, ws->b, guess, sum_of_charges, ws->x, ws->krylov, iters);
+}
+
+/* Multiply vector by EEM matrix with interactions limited by the cutoff */
+static void matvec_cutoff(const void * const ctx, const double * const x, double * const y) {
+
+	assert(ctx != NULL);
+
+	const struct cutoff_system * const sys = (const struct cutoff_system *) ctx;
+	const struct neighbour_list * const nl = sys->nl;
+	const int n = nl->atoms_count;
+
+	double sum = 0.0;
+	for(int i = 0; i < n; i++) {
+		double coupling = 0.0;
+		for(long int k = nl->starts[i]; k < nl->starts[i + 1]; k++)
+			coupling += nl->rdists[k] * x[nl->idx[k]];
+
+		y[i] = sys->diag[i] * x[i] + sys->kappa * coupling + x[n];
+		sum += x[i];
+	}
+	y[n] = sum;
+}
+
+/* Calculate charges with kappa/r interactions limited by the cutoff; the resulting
+ * sparse systems are solved by MINRES. Plain truncation changes charges a lot, so
+ * the kernel is shifted to 1/r - 1/Rc and beta is lowered by kappa/Rc. Up to the
+ * total charge constraint, this is the dense system with the distance of every
+ * pair beyond the cutoff set to Rc. */
+static void calculate_charges_cutoff(struct kappa_data * const kd, const int * const starts, int nthreads) {
+
+	assert(kd != NULL);
+	assert(starts != NULL);
+
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
 	for(int i = 0; i < ts.molecules_count; i++) {
 		#define MOLECULE ts.molecules[i]
 		const int n = MOLECULE.atoms_count;
+		float * const charges = kd->charges + starts[i];
 
-		void *tmp1 = NULL;
-		void *tmp2 = NULL;
-		posix_memalign(&tmp1, 64, ((n + 1) * (n + 2)) / 2 * sizeof(double));
-		posix_memalign(&tmp2, 64, (n + 1) * sizeof(double));
-		double *Ap = (double *) tmp1;
-		double *b = (double *) tmp2;
-		if(!Ap || !b)
-			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM system.\n");
+		struct neighbour_list nl;
+		nl_build(&nl, &MOLECULE, s.cutoff);
 
-		fill_EEM_matrix_packed(Ap, &ts.molecules[i], kd);
+		/* The preconditioner overwrites the tail of krylov, so keep diag in work */
+		struct eem_workspace * const ws = get_workspace(n);
+		double * const diag = ws->work;
+		double * const b = ws->b;
+		double * const x = ws->x;
+
+		int valid = 1;
+		for(int j = 0; j < n; j++) {
+			const int at_idx = ts.atom_type_idx[ts.molecule_starts[i] + j];
+			diag[j] = kd->parameters_beta[at_idx] - kd->kappa / s.cutoff;
+			b[j] = - kd->parameters_alpha[at_idx];
+			if(!isfinite(diag[j]) || !isfinite(b[j]))
+				valid = 0;
+		}
+		b[n] = MOLECULE.sum_of_charges;
+
+		for(long int k = 0; k < nl.starts[n]; k++) {
+			nl.rdists[k] -= 1.0 / s.cutoff;
+			if(!isfinite(nl.rdists[k]))
+				valid = 0;
+		}
+
+		int info = 1;
+		if(valid) {
+			const struct cutoff_system sys = {&nl, diag, kd->kappa};
+			int iters;
+			info = solve_eem_minres(n, matvec_cutoff, &sys, diag, b, charges, MOLECULE.sum_of_charges, x, ws->krylov, &iters);
+
+			#pragma omp atomic
+			kd->solver_iterations += iters;
+		} else
+			fprintf(stderr, "Invalid EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
+
+		if(valid && info)
+			fprintf(stderr, "Cannot solve EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
 
-		/* Fill vector b */
 		for(int j = 0; j < n; j++)
-			b[j] = - kd->parameters_alpha[get_atom_type_idx(&MOLECULE.atoms[j])];
+			charges[j] = info ? (float) 0.0 / 0.0 : (float) x[j];
+
+		kd->per_molecule_stats[i].cond = 0.0f;
+
+		/* Report the error of the approximation where the dense solution is affordable */
+		if(s.verbosity >= VERBOSE_DISCARD && !info && n <= CUTOFF_CHECK_MAX_ATOMS)
+			print_dense_difference("Cutoff", i, kd, charges);
+
+		nl_destroy(&nl);
+		#undef MOLECULE
+	}
+}
+
+/* Multiply vector by EEM matrix with kappa/r interactions evaluated by the treecode */
+static void matvec_treecode(const void * const ctx, const double * const x, double * const y) {
+
+	assert(ctx != NULL);
+
+	const struct treecode_system * const sys = (const struct treecode_system *) ctx;
+	const int n = sys->tc->atoms_count;
+
+	tc_potential(sys->tc, x, sys->phi, sys->nthreads);
+
+	double sum = 0.0;
+	for(int i = 0; i < n; i++) {
+		y[i] = sys->diag[i] * x[i] + sys->kappa * sys->phi[i] + x[n];
+		sum += x[i];
+	}
+	y[n] = sum;
+}
+
+/* Solve EEM system of the i-th molecule densely; used to check the approximate
+ * solvers. Return 0 on success. */
+static int solve_dense(int i, const struct kappa_data * const kd, double * const q) {
+
+	assert(kd != NULL);
+	assert(q != NULL);
+
+	const struct molecule * const m = &ts.molecules[i];
+	int nn = m->atoms_count + 1;
+	int nrhs = 1;
+	char uplo = 'U';
+	int info;
+
+	double *Ap = (double *) malloc(((long int) nn * (nn + 1)) / 2 * sizeof(double));
+	int *ipiv = (int *) malloc(nn * sizeof(int));
+	if(!Ap || !ipiv)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM system.\n");
+
+	fill_EEM_matrix_packed(Ap, i, kd);
+	for(int j = 0; j < m->atoms_count; j++)
+		q[j] = - kd->parameters_alpha[ts.atom_type_idx[ts.molecule_starts[i] + j]];
+	q[m->atoms_count] = m->sum_of_charges;
+
+	#ifdef USE_MKL
+	info = LAPACKE_dspsv(LAPACK_COL_MAJOR, uplo, nn, nrhs, Ap, ipiv, q, nn);
+	#else
+	dspsv_(&uplo, &nn, &nrhs, Ap, ipiv, q, &nn, &info);
+	#endif /* USE_MKL */
+
+	free(Ap);
+	free(ipiv);
+
+	return info;
+}
+
+/* Print how much the charges differ from the dense solution of the i-th molecule */
+static void print_dense_difference(const char * const method, int i, const struct kappa_data * const kd, const float * const charges) {
+
+	assert(method != NULL);
+	assert(kd != NULL);
+	assert(charges != NULL);
+
+	const struct molecule * const m = &ts.molecules[i];
+	const int n = m->atoms_count;
+	double *q = (double *) malloc((n + 1) * sizeof(double));
+	if(!q)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM system.\n");
+
+	if(!solve_dense(i, kd, q)) {
+		double max_diff = 0.0;
+		double sum_diff2 = 0.0;
+		for(int j = 0; j < n; j++) {
+			const double diff = fabs(charges[j] - q[j]);
+			if(diff > max_diff)
+				max_diff = diff;
+			sum_diff2 += diff * diff;
+		}
+
+		printf("%s check for molecule %s (%d atoms): max |dq| = %.2e, RMS dq = %.2e\n",
+		       method, m->name, n, max_diff, sqrt(sum_diff2 / n));
+	}
+
+	free(q);
+}
+
+/* Calculate charges by GMRES with the matrix-vector product evaluated by the
+ * treecode; molecules are processed one by one, each product in parallel */
+static void calculate_charges_treecode(struct kappa_data * const kd, const int * const starts, int nthreads) {
+
+	assert(kd != NULL);
+	assert(starts != NULL);
+
+	for(int i = 0; i < ts.molecules_count; i++) {
+		#define MOLECULE ts.molecules[i]
+		const int n = MOLECULE.atoms_count;
+		const int nn = n + 1;
+		float * const charges = kd->charges + starts[i];
 
+		struct treecode tc;
+		tc_build(&tc, &MOLECULE, s.treecode_theta);
+
+		/* The preconditioner is kept after the GMRES work vectors */
+		struct eem_workspace * const ws = get_workspace(n);
+		double * const diag = ws->work;
+		double * const phi = ws->work + nn;
+		double * const b = ws->b;
+		double * const x = ws->x;
+		double * const work = ws->krylov;
+		double * const minv = ws->krylov + GMRES_WORK_SIZE(nn, TREECODE_GMRES_RESTART);
+
+		int valid = 1;
+		for(int j = 0; j < n; j++) {
+			const int at_idx = ts.atom_type_idx[ts.molecule_starts[i] + j];
+			diag[j] = kd->parameters_beta[at_idx];
+			b[j] = - kd->parameters_alpha[at_idx];
+			if(!isfinite(diag[j]) || !isfinite(b[j]))
+				valid = 0;
+		}
 		b[n] = MOLECULE.sum_of_charges;
 
-		/* Solve EEM system */
+		int info = 1;
+		int iters = 0;
+		if(valid) {
+			const struct treecode_system sys = {&tc, diag, phi, kd->kappa, nthreads};
+
+			eem_preconditioner(n, diag, minv);
+			eem_initial_guess(n, matvec_treecode, &sys, b, charges, MOLECULE.sum_of_charges, x, work);
+			info = gmres(nn, matvec_treecode, &sys, b, x, minv, s.solver_tolerance, s.solver_max_iters,
+				     TREECODE_GMRES_RESTART, &iters, work);
+
+			kd->solver_iterations += iters;
+		} else
+			fprintf(stderr, "Invalid EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
+
+		if(valid && info)
+			fprintf(stderr, "Cannot solve EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
+
+		for(int j = 0; j < n; j++)
+			charges[j] = info ? (float) 0.0 / 0.0 : (float) x[j];
+
+		kd->per_molecule_stats[i].cond = 0.0f;
+
+		/* Report the error of the approximation where the dense solution is affordable */
+		if(s.verbosity >= VERBOSE_DISCARD && !info && n <= TREECODE_CHECK_MAX_ATOMS)
+			print_dense_difference("Treecode", i, kd, charges);
+
+		tc_destroy(&tc);
+		#undef MOLECULE
+	}
+}
 
-		double rcond;
-		int ipiv[n + 1];
+/* Solve EEM system of fragment f of the i-th molecule densely and store the charges
+ * of its core atoms; pos (three coordinates) and types are buffers large enough for
+ * the whole fragment. Return 0 on success. */
+static int solve_fragment(int i, const struct fragments * const fr, int f, const struct kappa_data * const kd,
+			  float * const pos, int * const types, float * const charges) {
+
+	assert(fr != NULL);
+	assert(kd != NULL);
+	assert(pos != NULL);
+	assert(types != NULL);
+	assert(charges != NULL);
+
+	const int * const idx = fr->idx + fr->starts[f];
+	const int n = (int) (fr->starts[f + 1] - fr->starts[f]);
+	const int start = ts.molecule_starts[i];
+
+	float * const x = pos;
+	float * const y = pos + n;
+	float * const z = pos + 2 * n;
+	for(int j = 0; j < n; j++) {
+		x[j] = ts.pos_x[start + idx[j]];
+		y[j] = ts.pos_y[start + idx[j]];
+		z[j] = ts.pos_z[start + idx[j]];
+		types[j] = ts.atom_type_idx[start + idx[j]];
+	}
+
+	/* The total charge is split proportionally to the number of atoms and fixed
+	 * by the renormalization afterwards */
+	const double sum_of_charges = (double) ts.molecules[i].sum_of_charges * n / ts.molecules[i].atoms_count;
+
+	struct eem_workspace * const ws = get_workspace(n);
+	fill_EEM_matrix_atoms(ws->Ap, n, x, y, z, types, NULL, kd);
+	if(check_matrix_packed(ws->Ap, n))
+		return 1;
+
+	for(int j = 0; j < n; j++)
+		ws->b[j] = - kd->parameters_alpha[types[j]];
+	ws->b[n] = sum_of_charges;
+
+	int nn = n + 1;
+	int info = 1;
+	const double *solution = ws->b;
+
+	const int small_size = small_solver_size(nn);
+	if(small_size) {
+		info = solve_small(ws, n, small_size);
+		solution = ws->bs;
+	}
+
+	if(info) {
 		char uplo = 'U';
-		int nn = n + 1;
 		int nrhs = 1;
-		int ldb = n + 1;
+		#ifdef USE_MKL
+		info = LAPACKE_dspsv(LAPACK_COL_MAJOR, uplo, nn, nrhs, ws->Ap, ws->ipiv, ws->b, nn);
+		#else
+		dspsv_(&uplo, &nn, &nrhs, ws->Ap, ws->ipiv, ws->b, &nn, &info);
+		#endif /* USE_MKL */
+		solution = ws->b;
+	}
 
-		double *Afp = NULL;
-		double *x = NULL;
+	if(!info)
+		for(int j = 0; j < fr->core_counts[f]; j++)
+			charges[idx[j]] = (float) solution[j];
 
-		if(check_matrix_packed(Ap, n) && s.mode == MODE_CHARGES) {
-			fprintf(stderr, "Invalid EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
+	return info;
+}
+
+/* Calculate charges by splitting the molecules into spatial fragments with buffer
+ * regions, solving them densely in parallel and renormalizing the total charge */
+static void calculate_charges_fragments(struct kappa_data * const kd, const int * const starts, int nthreads) {
+
+	assert(kd != NULL);
+	assert(starts != NULL);
+
+	for(int i = 0; i < ts.molecules_count; i++) {
+		#define MOLECULE ts.molecules[i]
+		const int n = MOLECULE.atoms_count;
+		float * const charges = kd->charges + starts[i];
+
+		struct fragments fr;
+		fr_build(&fr, &MOLECULE, s.fragment_size, s.fragment_buffer);
+
+		int failed = 0;
+		#pragma omp parallel num_threads(nthreads) reduction(|:failed)
+		{
+			float *pos = NULL;
+			int *types = NULL;
+			int atoms_allocated = 0;
+
+			#pragma omp for schedule(dynamic)
+			for(int f = 0; f < fr.count; f++) {
+				const int fn = (int) (fr.starts[f + 1] - fr.starts[f]);
+				if(fn > atoms_allocated) {
+					free(pos);
+					free(types);
+					pos = (float *) malloc(3 * fn * sizeof(float));
+					types = (int *) malloc(fn * sizeof(int));
+					if(!pos || !types)
+						EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for fragments.\n");
+					atoms_allocated = fn;
+				}
+
+				if(solve_fragment(i, &fr, f, kd, pos, types, charges))
+					failed = 1;
+			}
+
+			free(pos);
+			free(types);
+		}
+
+		if(failed) {
+			fprintf(stderr, "Cannot solve EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
+			for(int j = 0; j < n; j++)
+				charges[j] = (float) 0.0 / 0.0;
+		} else {
+			/* Spread the deviation from the total charge evenly over the atoms */
+			double sum = 0.0;
 			for(int j = 0; j < n; j++)
-				kd->charges[starts[i] + j] = (float) 0.0 / 0.0;
+				sum += charges[j];
+
+			const double shift = (MOLECULE.sum_of_charges - sum) / n;
+			for(int j = 0; j < n; j++)
+				charges[j] = (float) (charges[j] + shift);
+
+			if(s.verbosity >= VERBOSE_DISCARD) {
+				long int atoms_max = 0;
+				for(int f = 0; f < fr.count; f++)
+					if(fr.starts[f + 1] - fr.starts[f] > atoms_max)
+						atoms_max = fr.starts[f + 1] - fr.starts[f];
 
-			goto out;
+				printf("Molecule %s: %d fragments of at most %ld atoms, charge shift %.2e\n",
+				       MOLECULE.name, fr.count, atoms_max, shift);
+
+				if(n <= FRAGMENTS_CHECK_MAX_ATOMS)
+					print_dense_difference("Fragments", i, kd, charges);
+			}
 		}
 
-		if(s.extra_precise) {
-			char fact = 'N';
-			double ferr, berr;
-			int ldx = nn;
+		kd->per_molecule_stats[i].cond = 0.0f;
 
-			tmp1 = NULL;
-			tmp2 = NULL;
-			posix_memalign(&tmp1, 64, ((n + 1) * (n + 2)) / 2 * sizeof(double));
-			posix_memalign(&tmp2, 64, (n + 1) * sizeof(double));
-			Afp = (double *) tmp1;
-			x = (double *) tmp2;
+		fr_destroy(&fr);
+		#undef MOLECULE
+	}
+}
 
-			if(!Afp || !x)
-				EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM system.\n");
+/* Solve EEM system stored in the workspace using single precision factorization
+ * followed by iterative refinement in double precision (as LAPACK's dsgesv does);
+ * the solution is left in ws->x. Return 0 if the refinement converged. */
+static int solve_mixed_precision(struct eem_workspace * const ws, int n) {
 
-			int info;
-			#ifdef USE_MKL
-			info = LAPACKE_dspsvx(LAPACK_COL_MAJOR, fact, uplo, nn, nrhs, Ap, Afp, ipiv, b, ldb, x, ldx, &rcond, &ferr, &berr);
-			#else
-			int iwork[n + 1];
-			double work[3 * (n + 1)];
+	assert(ws != NULL);
 
-			dspsvx_(&fact, &uplo, &nn, &nrhs, Ap, Afp, ipiv, b, &ldb, x, &ldx, &rcond, &ferr, &berr, work, iwork, &info);
-			#endif /* USE_MKL */
+	int nn = n + 1;
+	int nrhs = 1;
+	char uplo = 'U';
+	int info;
+	const long int packed = ((long int) nn * (nn + 1)) / 2;
+	const struct packed_system sys = {ws->Ap, nn};
+	double * const x = ws->x;
+	double * const r = ws->work;
+	float * const Asp = ws->Asp;
+	float * const bsp = ws->bsp;
+
+	/* Infinity norm of the matrix; it is symmetric, so sum the columns */
+	double * const row_sums = ws->work + nn;
+	for(int i = 0; i < nn; i++)
+		row_sums[i] = 0.0;
+
+	for(long int j = 0; j < nn; j++) {
+		const double * const col = ws->Ap + (j * (j + 1)) / 2;
+		for(long int i = 0; i < j; i++) {
+			row_sums[i] += fabs(col[i]);
+			row_sums[j] += fabs(col[i]);
+		}
+		row_sums[j] += fabs(col[j]);
+	}
+
+	double anrm = 0.0;
+	for(int i = 0; i < nn; i++)
+		if(row_sums[i] > anrm)
+			anrm = row_sums[i];
+
+	const double cte = anrm * DBL_EPSILON * sqrt((double) nn);
+
+	for(long int i = 0; i < packed; i++)
+		Asp[i] = (float) ws->Ap[i];
+
+	#ifdef USE_MKL
+	info = LAPACKE_ssptrf(LAPACK_COL_MAJOR, uplo, nn, Asp, ws->ipiv);
+	#else
+	ssptrf_(&uplo, &nn, Asp, ws->ipiv, &info);
+	#endif /* USE_MKL */
+	if(info)
+		return 1;
+
+	for(int i = 0; i < nn; i++) {
+		bsp[i] = (float) ws->b[i];
+		x[i] = 0.0;
+	}
+
+	for(int step = 0; step <= MAX_REFINEMENT_STEPS; step++) {
+		/* Solve for the correction and update the solution */
+		#ifdef USE_MKL
+		info = LAPACKE_ssptrs(LAPACK_COL_MAJOR, uplo, nn, nrhs, Asp, ws->ipiv, bsp, nn);
+		#else
+		ssptrs_(&uplo, &nn, &nrhs, Asp, ws->ipiv, bsp, &nn, &info);
+		#endif /* USE_MKL */
+		if(info)
+			return 1;
+
+		for(int i = 0; i < nn; i++)
+			x[i] += bsp[i];
+
+		/* Compute the residual in double precision */
+		matvec_packed(&sys, x, r);
+		double rnrm = 0.0;
+		double xnrm = 0.0;
+		for(int i = 0; i < nn; i++) {
+			r[i] = ws->b[i] - r[i];
+			if(fabs(r[i]) > rnrm)
+				rnrm = fabs(r[i]);
+			if(fabs(x[i]) > xnrm)
+				xnrm = fabs(x[i]);
+		}
+
+		if(rnrm <= xnrm * cte)
+			return 0;
+
+		for(int i = 0; i < nn; i++)
+			bsp[i] = (float) r[i];
+	}
+
+	return 1;
+}
+
+/* Solve EEM system stored in the workspace by the kernel for systems of the given
+ * size; the system is padded by identity. The solution is left in ws->bs. Return 0
+ * on success; the packed system is kept for the fallback otherwise. */
+static int solve_small(struct eem_workspace * const ws, int n, int size) {
+
+	assert(ws != NULL);
+
+	const long int nn = n + 1;
+	double * const A = ws->As;
+
+	/* Copy the upper triangle from the packed storage */
+	for(long int j = 0; j < nn; j++) {
+		const double * const col = ws->Ap + (j * (j + 1)) / 2;
+		for(long int i = 0; i <= j; i++)
+			A[i * size + j] = col[i];
+		for(long int i = j + 1; i < size; i++)
+			A[i * size + j] = 0.0;
+	}
+
+	for(long int j = nn; j < size; j++)
+		for(long int i = 0; i < size; i++)
+			A[i * size + j] = i == j ? 1.0 : 0.0;
+
+	for(long int i = 0; i < size; i++)
+		ws->bs[i] = i < nn ? ws->b[i] : 0.0;
+
+	if(small_solve(A, ws->bs, size))
+		return 1;
 
-			kd->per_molecule_stats[i].cond = (float) (1.0 / rcond);
+	return !is_solution_accurate(ws->Ap, ws->b, ws->bs, (int) nn, ws->x);
+}
+
+/* Check solution x of the system given by packed Ap and b by its normwise backward
+ * error, ||b - Ax|| <= tol * (||A|| ||x|| + ||b||) in max norms with ||A|| bounded by
+ * nn times its largest element; r is work vector of size nn. Return 1 if it passes. */
+static int is_solution_accurate(const double * const Ap, const double * const b, const double * const x, int nn, double * const r) {
+
+	assert(Ap != NULL);
+	assert(b != NULL);
+	assert(x != NULL);
+	assert(r != NULL);
+
+	double amax = 0.0;
+	for(int i = 0; i < nn; i++)
+		r[i] = b[i];
 
-			if(s.mode == MODE_CHARGES && (1 / rcond) > WARN_MAX_COND)
-				fprintf(stderr, "Ill-conditioned EEM system for molecule %s. Charges might be inaccurate.\n", MOLECULE.name);
+	for(long int j = 0; j < nn; j++) {
+		const double * const col = Ap + (j * (j + 1)) / 2;
+		double sum = 0.0;
+		for(long int i = 0; i < j; i++) {
+			r[i] -= col[i] * x[j];
+			sum += col[i] * x[i];
+			if(fabs(col[i]) > amax)
+				amax = fabs(col[i]);
+		}
+		r[j] -= sum + col[j] * x[j];
+		if(fabs(col[j]) > amax)
+			amax = fabs(col[j]);
+	}
 
+	double r_max = 0.0, x_max = 0.0, b_max = 0.0;
+	for(int i = 0; i < nn; i++) {
+		/* NaN in the solution fails the test as well */
+		if(isnan(r[i]))
+			return 0;
+
+		if(fabs(r[i]) > r_max)
+			r_max = fabs(r[i]);
+		if(fabs(x[i]) > x_max)
+			x_max = fabs(x[i]);
+		if(fabs(b[i]) > b_max)
+			b_max = fabs(b[i]);
+	}
+
+	return r_max <= SMALL_SOLVER_RESIDUAL_TOL * (nn * amax * x_max + b_max);
+}
+
+/* Order molecules by the number of atoms; ties are broken by the index */
+static int compare_atoms_count(const void *p1, const void *p2) {
+
+	const int i1 = *((const int *) p1);
+	const int i2 = *((const int *) p2);
+
+	if(ts.molecules[i1].atoms_count != ts.molecules[i2].atoms_count)
+		return ts.molecules[i1].atoms_count - ts.molecules[i2].atoms_count;
+
+	return i1 - i2;
+}
 
-			if(info) {
-				fprintf(stderr, "Cannot solve EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
-				for(int j = 0; j < n; j++)
-					kd->charges[starts[i] + j] = (float) 0.0 / 0.0;
-			} else {
-				/* Store computed charges */
-				for(int j = 0; j < n; j++)
-					kd->charges[starts[i] + j] = (float) x[j];
+/* Calculate charges of molecules with the same number of atoms together, up to
+ * BATCH_WIDTH at once. Return array marking the molecules that were solved; the
+ * remaining ones have to be solved one by one. */
+static int *calculate_charges_batched(struct kappa_data * const kd, const int * const starts, int nthreads) {
+
+	assert(kd != NULL);
+	assert(starts != NULL);
+
+	int *solved = (int *) calloc(ts.molecules_count, sizeof(int));
+	int *order = (int *) malloc(ts.molecules_count * sizeof(int));
+	int *batches = (int *) malloc(2 * ts.molecules_count * sizeof(int));
+	if(!solved || !order || !batches)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for batched solver.\n");
+
+	for(int i = 0; i < ts.molecules_count; i++)
+		order[i] = i;
+
+	qsort(order, ts.molecules_count, sizeof(int), compare_atoms_count);
+
+	/* Split groups of at least two equally sized molecules into batches;
+	 * batch k consists of order[batches[2k]] ... order[batches[2k + 1] - 1] */
+	int batches_count = 0;
+	for(int i = 0; i < ts.molecules_count;) {
+		const int n = ts.molecules[order[i]].atoms_count;
+		int j = i + 1;
+		while(j < ts.molecules_count && ts.molecules[order[j]].atoms_count == n)
+			j++;
+
+		if(j - i >= 2 && n + 1 <= SMALL_SOLVER_MAX_SIZE)
+			for(int k = i; k < j; k += BATCH_WIDTH) {
+				batches[2 * batches_count] = k;
+				batches[2 * batches_count + 1] = k + BATCH_WIDTH < j ? k + BATCH_WIDTH : j;
+				batches_count++;
 			}
 
-			free(Afp);
-			free(x);
+		i = j;
+	}
+
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+	for(int k = 0; k < batches_count; k++) {
+		const int first = batches[2 * k];
+		const int count = batches[2 * k + 1] - first;
+		const int n = ts.molecules[order[first]].atoms_count;
+		const long int nn = n + 1;
+
+		struct eem_workspace * const ws = get_workspace(n);
+		double * const A = ws->Ab;
+		double * const b = ws->bb;
+
+		#define A_IDX(i, j) (((i) * nn + (j)) * BATCH_WIDTH)
+		int valid[BATCH_WIDTH];
+		for(int l = 0; l < BATCH_WIDTH; l++) {
+			valid[l] = 0;
+			if(l < count) {
+				const struct molecule * const m = &ts.molecules[order[first + l]];
+				const int * const types = ts.atom_type_idx + ts.molecule_starts[order[first + l]];
+				fill_EEM_matrix_packed(ws->Ap, order[first + l], kd);
+
+				/* Invalid systems are reported by the per-molecule path */
+				if(!check_matrix_packed(ws->Ap, n)) {
+					valid[l] = 1;
+					for(long int j = 0; j < nn; j++) {
+						const double * const col = ws->Ap + (j * (j + 1)) / 2;
+						for(long int i = 0; i <= j; i++)
+							A[A_IDX(i, j) + l] = col[i];
+					}
+
+					for(int j = 0; j < n; j++)
+						b[j * BATCH_WIDTH + l] = - kd->parameters_alpha[types[j]];
+					b[n * BATCH_WIDTH + l] = m->sum_of_charges;
+				}
+			}
+
+			/* Unused lanes get identity */
+			if(!valid[l]) {
+				for(long int j = 0; j < nn; j++) {
+					for(long int i = 0; i < j; i++)
+						A[A_IDX(i, j) + l] = 0.0;
+					A[A_IDX(j, j) + l] = 1.0;
+					b[j * BATCH_WIDTH + l] = 0.0;
+				}
+			}
+		}
+		#undef A_IDX
+
+		int failed[BATCH_WIDTH];
+		batch_solve(A, b, nn, failed);
+
+		for(int l = 0; l < count; l++) {
+			if(!valid[l] || failed[l])
+				continue;
+
+			/* The kernel doesn't pivot, so check the solution against the system
+			 * filled again; the per-molecule path takes over if it's not accurate */
+			const int i = order[first + l];
+			const int * const types = ts.atom_type_idx + ts.molecule_starts[i];
+			fill_EEM_matrix_packed(ws->Ap, i, kd);
+			for(int j = 0; j < n; j++) {
+				ws->b[j] = - kd->parameters_alpha[types[j]];
+				ws->x[j] = b[j * BATCH_WIDTH + l];
+			}
+			ws->b[n] = ts.molecules[i].sum_of_charges;
+			ws->x[n] = b[n * BATCH_WIDTH + l];
+
+			if(!is_solution_accurate(ws->Ap, ws->b, ws->x, (int) nn, ws->bs))
+				continue;
+
+			for(int j = 0; j < n; j++)
+				kd->charges[starts[i] + j] = (float) b[j * BATCH_WIDTH + l];
+
+			kd->per_molecule_stats[i].cond = 0.0f;
+			solved[i] = 1;
+		}
+	}
+
+	free(order);
+	free(batches);
+
+	return solved;
+}
+
+/* Solve the system by the fixed-size kernels */
+static int backend_small(struct eem_workspace * const ws, int n, const float * const guess __attribute__ ((unused)),
+			 double sum_of_charges __attribute__ ((unused)), int * const iters, const double ** const solution) {
+
+	assert(ws != NULL);
+
+	*iters = 0;
+	*solution = ws->bs;
+
+	const int size = small_solver_size(n + 1);
+	if(!size)
+		return 1;
+
+	return solve_small(ws, n, size);
+}
+
+/* Solve the system in packed storage; the matrix and right-hand side are overwritten */
+static int backend_packed(struct eem_workspace * const ws, int n, const float * const guess __attribute__ ((unused)),
+			  double sum_of_charges __attribute__ ((unused)), int * const iters, const double ** const solution) {
+
+	assert(ws != NULL);
+
+	char uplo = 'U';
+	int nn = n + 1;
+	int nrhs = 1;
+	int info;
+
+	*iters = 0;
+	*solution = ws->b;
+
+	#ifdef USE_MKL
+	info = LAPACKE_dspsv(LAPACK_COL_MAJOR, uplo, nn, nrhs, ws->Ap, ws->ipiv, ws->b, nn);
+	#else
+	dspsv_(&uplo, &nn, &nrhs, ws->Ap, ws->ipiv, ws->b, &nn, &info);
+	#endif /* USE_MKL */
+
+	return info;
+}
+
+/* Solve the system by the blocked factorization of its full storage copy */
+static int backend_full(struct eem_workspace * const ws, int n, const float * const guess __attribute__ ((unused)),
+			double sum_of_charges __attribute__ ((unused)), int * const iters, const double ** const solution) {
+
+	assert(ws != NULL);
+
+	char uplo = 'U';
+	int nn = n + 1;
+	int nrhs = 1;
+	int lwork = FULL_SOLVER_BLOCK * nn;
+	int info;
+
+	*iters = 0;
+	*solution = ws->x;
+
+	if(ws->Af == NULL) {
+		const long int nn_max = ws->atoms_max + 1;
+		void *tmp1 = NULL, *tmp2 = NULL;
+		posix_memalign(&tmp1, 64, nn_max * nn_max * sizeof(double));
+		posix_memalign(&tmp2, 64, FULL_SOLVER_BLOCK * nn_max * sizeof(double));
+		ws->Af = (double *) tmp1;
+		ws->fwork = (double *) tmp2;
+		if(!ws->Af || !ws->fwork)
+			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM system.\n");
+	}
+
+	/* Only the upper triangle is referenced */
+	for(long int j = 0; j < nn; j++)
+		memcpy(ws->Af + j * nn, ws->Ap + (j * (j + 1)) / 2, (j + 1) * sizeof(double));
+	memcpy(ws->x, ws->b, nn * sizeof(double));
+
+	#ifdef USE_MKL
+	info = LAPACKE_dsysv(LAPACK_COL_MAJOR, uplo, nn, nrhs, ws->Af, nn, ws->ipiv, ws->x, nn);
+	#else
+	dsysv_(&uplo, &nn, &nrhs, ws->Af, &nn, ws->ipiv, ws->x, &nn, ws->fwork, &lwork, &info);
+	#endif /* USE_MKL */
+
+	return info;
+}
+
+/* Solve the system by MINRES starting from the charges in guess */
+static int backend_minres(struct eem_workspace * const ws, int n, const float * const guess, double sum_of_charges,
+			  int * const iters, const double ** const solution) {
+
+	assert(ws != NULL);
+
+	*solution = ws->x;
+
+	return solve_minres(ws, n, guess, sum_of_charges, iters);
+}
+
+/* Fill EEM system of n atoms of two kinds (with parameters similar to hydrogen and
+ * carbon) placed on a distorted cubic grid with spacing similar to the bond
+ * lengths; used to measure the backends */
+static void fill_tuning_system(double * const Ap, double * const b, int n) {
+
+	assert(Ap != NULL);
+	assert(b != NULL);
+
+	const int side = (int) ceil(cbrt(n));
+	double *pos = (double *) malloc(3 * n * sizeof(double));
+	if(!pos)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM system.\n");
+
+	for(int i = 0; i < n; i++) {
+		pos[3 * i] = 1.5 * (i % side) + 0.2 * sin(1.3 * i);
+		pos[3 * i + 1] = 1.5 * ((i / side) % side) + 0.2 * sin(2.1 * i);
+		pos[3 * i + 2] = 1.5 * (i / (side * side)) + 0.2 * sin(2.9 * i);
+	}
+
+	#define U_IDX(x, y) (x + (y * (y + 1))/2)
+	for(long int i = 0; i < n; i++) {
+		Ap[U_IDX(i, i)] = i % 2 ? 0.57 : 0.25;
+		b[i] = i % 2 ? -2.38 : -2.49;
+		for(long int j = i + 1; j < n; j++) {
+			const double dx = pos[3 * i] - pos[3 * j];
+			const double dy = pos[3 * i + 1] - pos[3 * j + 1];
+			const double dz = pos[3 * i + 2] - pos[3 * j + 2];
+			Ap[U_IDX(i, j)] = 0.2 / sqrt(dx * dx + dy * dy + dz * dz);
+		}
+	}
+
+	for(long int i = 0; i < n; i++)
+		Ap[U_IDX(i, (long int) n)] = 1.0;
+
+	Ap[U_IDX((long int) n, (long int) n)] = 0.0;
+	b[n] = 0.0;
+	#undef U_IDX
+
+	free(pos);
+}
+
+/* Return the backend that solves EEM system of n atoms in the shortest time */
+static int measure_fastest_backend(int n) {
+
+	const int nn = n + 1;
+	const long int packed = ((long int) nn * (nn + 1)) / 2;
+
+	struct eem_workspace * const ws = get_workspace(n);
+	double *Ap = (double *) malloc(packed * sizeof(double));
+	double *b = (double *) malloc(nn * sizeof(double));
+	float *guess = (float *) calloc(n, sizeof(float));
+	if(!Ap || !b || !guess)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for EEM system.\n");
+
+	fill_tuning_system(Ap, b, n);
+
+	int fastest = BACKEND_PACKED;
+	double best_time = DBL_MAX;
+	for(int k = 0; k < BACKENDS_COUNT; k++) {
+		if(backends[k].max_size && nn > backends[k].max_size)
+			continue;
+
+		/* Repeat the solution until the time can be measured reliably */
+		double elapsed = 0.0;
+		int runs = 0;
+		int failed = 0;
+		while(!failed && (runs == 0 || elapsed < TUNING_MIN_TIME)) {
+			memcpy(ws->Ap, Ap, packed * sizeof(double));
+			memcpy(ws->b, b, nn * sizeof(double));
+
+			int iters;
+			const double *solution;
+			const double start = omp_get_wtime();
+			failed = backends[k].solve(ws, n, guess, b[n], &iters, &solution);
+			elapsed += omp_get_wtime() - start;
+			runs++;
+		}
+
+		if(!failed && elapsed / runs < best_time) {
+			best_time = elapsed / runs;
+			fastest = k;
+		}
+	}
+
+	free(Ap);
+	free(b);
+	free(guess);
+
+	return fastest;
+}
+
+/* Load the fastest backend for each band of system sizes used by --eem-solver auto;
+ * if the tuning file is missing or invalid, measure them and store the file */
+void eem_tune_solvers(void) {
+
+	struct tuning_table tt;
+	int valid = !tt_load(&tt, s.tuning_file);
+
+	for(int k = 0; valid && k < TUNING_BANDS_COUNT; k++) {
+		band_backends[k] = -1;
+		for(int l = 0; l < BACKENDS_COUNT; l++)
+			if(!strcmp(tt.backends[k], backends[l].name))
+				band_backends[k] = l;
+
+		if(band_backends[k] == -1)
+			valid = 0;
+	}
+
+	if(valid)
+		printf("\nSolver tuning table loaded from %s\n", s.tuning_file);
+	else {
+		printf("\nMeasuring EEM solver backends, this is done only once...\n");
+		for(int k = 0; k < TUNING_BANDS_COUNT; k++) {
+			band_backends[k] = measure_fastest_backend(tuning_band_size(k) - 1);
+			strcpy(tt.backends[k], backends[band_backends[k]].name);
+		}
+
+		if(tt_save(&tt, s.tuning_file))
+			fprintf(stderr, "Cannot write tuning file %s. Backends will be measured again next time.\n", s.tuning_file);
+		else
+			printf("Solver tuning table stored to %s\n", s.tuning_file);
+	}
+
+	if(s.verbosity >= VERBOSE_DISCARD)
+		for(int k = 0; k < TUNING_BANDS_COUNT; k++)
+			printf("  systems up to %5d: %s\n", tuning_band_size(k), backends[band_backends[k]].name);
+}
+
+/* Solve EEM system of the i-th molecule and store its charges; on input, charges
+ * are the initial guess of the iterative solvers. The condition number is stored
+ * to cond and the iterations of the iterative solvers are added to iters. */
+void calculate_molecule_charges(const struct kappa_data * const kd, int i, float * const charges, float * const cond, int * const iters) {
+
+	assert(kd != NULL);
+	assert(charges != NULL);
+	assert(cond != NULL);
+	assert(iters != NULL);
+
+	#define MOLECULE ts.molecules[i]
+	const int n = MOLECULE.atoms_count;
+	const int start = ts.molecule_starts[i];
+
+	struct eem_workspace * const ws = get_workspace(n);
+	double * const Ap = ws->Ap;
+	double * const b = ws->b;
+
+	fill_EEM_matrix_packed(Ap, i, kd);
+
+	/* Fill vector b */
+	for(int j = 0; j < n; j++)
+		b[j] = - kd->parameters_alpha[ts.atom_type_idx[start + j]];
+
+	b[n] = MOLECULE.sum_of_charges;
+
+	/* Solve EEM system */
+
+	double rcond;
+	int * const ipiv = ws->ipiv;
+	char uplo = 'U';
+	int nn = n + 1;
+	int nrhs = 1;
+	int ldb = n + 1;
+
+	if(check_matrix_packed(Ap, n) && s.mode == MODE_CHARGES) {
+		fprintf(stderr, "Invalid EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
+		for(int j = 0; j < n; j++)
+			charges[j] = (float) 0.0 / 0.0;
+
+		return;
+	}
+
+	if(s.extra_precise) {
+		char fact = 'N';
+		double ferr, berr;
+		int ldx = nn;
+
+		double * const Afp = ws->Afp;
+		double * const x = ws->x;
+
+		int info;
+		#ifdef USE_MKL
+		info = LAPACKE_dspsvx(LAPACK_COL_MAJOR, fact, uplo, nn, nrhs, Ap, Afp, ipiv, b, ldb, x, ldx, &rcond, &ferr, &berr);
+		#else
+		dspsvx_(&fact, &uplo, &nn, &nrhs, Ap, Afp, ipiv, b, &ldb, x, &ldx, &rcond, &ferr, &berr, ws->work, ws->iwork, &info);
+		#endif /* USE_MKL */
+
+		*cond = (float) (1.0 / rcond);
+
+		if(s.mode == MODE_CHARGES && (1 / rcond) > WARN_MAX_COND)
+			fprintf(stderr, "Ill-conditioned EEM system for molecule %s. Charges might be inaccurate.\n", MOLECULE.name);
+
+
+		if(info) {
+			fprintf(stderr, "Cannot solve EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
+			for(int j = 0; j < n; j++)
+				charges[j] = (float) 0.0 / 0.0;
 		} else {
-			int info;
+			/* Store computed charges */
+			for(int j = 0; j < n; j++)
+				charges[j] = (float) x[j];
+		}
+	} else {
+		int info = 1;
+		const double *solution = b;
+
+		/* Packed storage is the fallback below, so it is not run twice */
+		if(s.eem_solver == SOLVER_FULL || s.eem_solver == SOLVER_AUTO) {
+			const int backend = s.eem_solver == SOLVER_FULL ? BACKEND_FULL : band_backends[tuning_band(nn)];
+			if(backend != BACKEND_PACKED) {
+				int molecule_iters;
+				info = backends[backend].solve(ws, n, charges, MOLECULE.sum_of_charges, &molecule_iters, &solution);
+				*iters += molecule_iters;
+			}
+		}
+
+		if(s.eem_solver == SOLVER_MINRES) {
+			int molecule_iters;
+			info = solve_minres(ws, n, charges, MOLECULE.sum_of_charges, &molecule_iters);
+			solution = ws->x;
+			*iters += molecule_iters;
+		}
+
+		if(info && s.mixed_precision) {
+			info = solve_mixed_precision(ws, n);
+			solution = ws->x;
+		}
+
+		const int small_size = small_solver_size(nn);
+		if(info && small_size && !s.mixed_precision && s.eem_solver != SOLVER_AUTO) {
+			info = solve_small(ws, n, small_size);
+			solution = ws->bs;
+		}
+
+		/* Use the direct solver in double precision if the others did not converge */
+		if(info) {
 			#ifdef USE_MKL
 			info = LAPACKE_dspsv(LAPACK_COL_MAJOR, uplo, nn, nrhs, Ap, ipiv, b, nn);
 			#else
 			dspsv_(&uplo, &nn, &nrhs, Ap, ipiv, b, &nn, &info);
 			#endif /* USE_MKL */
+			solution = b;
+		}
 
-			if(info) {
-				fprintf(stderr, "Cannot solve EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
-				for(int j = 0; j < n; j++)
-					kd->charges[starts[i] + j] = (float) 0.0 / 0.0;
-			} else {
-				/* Store computed charges */
-				for(int j = 0; j < n; j++)
-					kd->charges[starts[i] + j] = (float) b[j];
-			}
-
-			kd->per_molecule_stats[i].cond = 0.0f;
+		if(info) {
+			fprintf(stderr, "Cannot solve EEM system for molecule %s. Setting charges to NaN.\n", MOLECULE.name);
+			for(int j = 0; j < n; j++)
+				charges[j] = (float) 0.0 / 0.0;
+		} else {
+			/* Store computed charges */
+			for(int j = 0; j < n; j++)
+				charges[j] = (float) solution[j];
 		}
 
-		#undef MOLECULE
+		*cond = 0.0f;
+	}
+
+	#undef MOLECULE
+}
+
+/* Calculate charges for a particular kappa_data structure */
+void calculate_charges(struct subset * const ss, struct kappa_data * const kd) {
+
+	assert(ss != NULL);
+	assert(kd != NULL);
+
+	/* Charges of each molecule are stored from its first atom's index on, which
+	 * guarantees the independence of the for loop iterations */
+	const int * const starts = ts.molecule_starts;
+	int nt = s.max_threads;
+	if (s.params_method == PARAMS_DE || s.params_method == PARAMS_GM)
+		nt /= s.om_threads;
+
+	int nthreads = ts.molecules_count < nt ? ts.molecules_count : nt;
+
+	kd->solver_iterations = 0;
+
+	if(s.cutoff > 0.0f) {
+		calculate_charges_cutoff(kd, starts, nthreads);
+		return;
+	}
+
+	/* Molecules are processed one by one here, so use all the threads for each */
+	if(s.treecode_theta >= 0.0f) {
+		calculate_charges_treecode(kd, starts, nt);
+		return;
+	}
+
+	if(s.fragment_size > 0.0f) {
+		calculate_charges_fragments(kd, starts, nt);
+		return;
+	}
+
+	int *solved = NULL;
+	if(s.batched_solve)
+		solved = calculate_charges_batched(kd, starts, nthreads);
+
+	#pragma omp parallel for num_threads(nthreads)
+	for(int i = 0; i < ts.molecules_count; i++) {
+		if(solved != NULL && solved[i])
+			continue;
+
+		int iters = 0;
+		calculate_molecule_charges(kd, i, kd->charges + starts[i], &kd->per_molecule_stats[i].cond, &iters);
+
+		#pragma omp atomic
+		kd->solver_iterations += iters;
+	}
+
+	free(solved);
+}
+
+/* Calculate charges of the molecules of ss only, the charges of the others are left
+ * as they are; used where the statistics are calculated over the subset alone */
+void calculate_charges_for_subset(const struct subset * const ss, struct kappa_data * const kd) {
+
+	assert(ss != NULL);
+	assert(kd != NULL);
+
+	const int * const starts = ts.molecule_starts;
+	const int nthreads = ts.molecules_count < s.max_threads ? ts.molecules_count : s.max_threads;
+
+	kd->solver_iterations = 0;
+
+	#pragma omp parallel for num_threads(nthreads)
+	for(int i = 0; i < ts.molecules_count; i++) {
+		if(!b_get(&ss->molecules, i))
+			continue;
+
+		int iters = 0;
+		calculate_molecule_charges(kd, i, kd->charges + starts[i], &kd->per_molecule_stats[i].cond, &iters);
 
-		out:
-		/* Clean remaining things up */
-		free(Ap);
-		free(b);
+		#pragma omp atomic
+		kd->solver_iterations += iters;
 	}
 }
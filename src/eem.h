@@ -22,5 +22,9 @@
 #include "subset.h"
 
 void calculate_charges(struct subset * const ss, struct kappa_data * const kd);
+void calculate_charges_for_subset(const struct subset * const ss, struct kappa_data * const kd);
+void calculate_molecule_charges(const struct kappa_data * const kd, int i, float * const charges, float * const cond, int * const iters);
+void eem_destroy_workspaces(void);
+void eem_tune_solvers(void);
 
 #endif /* __EEM_H__ */
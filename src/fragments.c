@@ -0,0 +1,189 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "fragments.h"
+#include "neemp.h"
+
+/* Keep the number of cores proportional to the number of atoms */
+#define MAX_CORES_PER_ATOM 1
+
+static int core_coord(float x, float min, float size, int dim);
+
+/* Return index of the core along one axis */
+static int core_coord(float x, float min, float size, int dim) {
+
+	int c = (int) ((x - min) / size);
+	if(c >= dim)
+		c = dim - 1;
+
+	return c;
+}
+
+/* Split the molecule into cubic cores with given edge, each extended by the buffer */
+void fr_build(struct fragments * const fr, const struct molecule * const m, float size, float buffer) {
+
+	assert(fr != NULL);
+	assert(m != NULL);
+	assert(size > 0.0f);
+	assert(buffer >= 0.0f);
+
+	const int n = m->atoms_count;
+
+	/* Bounding box of the molecule */
+	float min[3], max[3];
+	for(int k = 0; k < 3; k++)
+		min[k] = max[k] = m->atoms[0].position[k];
+
+	for(int i = 1; i < n; i++)
+		for(int k = 0; k < 3; k++) {
+			if(m->atoms[i].position[k] < min[k])
+				min[k] = m->atoms[i].position[k];
+			if(m->atoms[i].position[k] > max[k])
+				max[k] = m->atoms[i].position[k];
+		}
+
+	/* Enlarge the cores of sparse molecules so that most of them are not empty */
+	int dim[3];
+	for(;;) {
+		long int cores = 1;
+		for(int k = 0; k < 3; k++) {
+			dim[k] = (int) ((max[k] - min[k]) / size) + 1;
+			cores *= dim[k];
+		}
+
+		if(cores <= (long int) MAX_CORES_PER_ATOM * n)
+			break;
+
+		size *= 2.0f;
+	}
+
+	const int cores_count = dim[0] * dim[1] * dim[2];
+	int *core = (int *) malloc(n * sizeof(int));
+	int *core_starts = (int *) calloc(cores_count + 1, sizeof(int));
+	int *core_atoms = (int *) malloc(n * sizeof(int));
+	if(!core || !core_starts || !core_atoms)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for fragments.\n");
+
+	/* Sort atoms by their cores */
+	for(int i = 0; i < n; i++) {
+		int c[3];
+		for(int k = 0; k < 3; k++)
+			c[k] = core_coord(m->atoms[i].position[k], min[k], size, dim[k]);
+
+		core[i] = (c[2] * dim[1] + c[1]) * dim[0] + c[0];
+		core_starts[core[i] + 1]++;
+	}
+
+	for(int c = 0; c < cores_count; c++)
+		core_starts[c + 1] += core_starts[c];
+
+	for(int i = 0; i < n; i++)
+		core_atoms[core_starts[core[i]]++] = i;
+
+	for(int c = cores_count; c > 0; c--)
+		core_starts[c] = core_starts[c - 1];
+	core_starts[0] = 0;
+
+	fr->count = 0;
+	for(int c = 0; c < cores_count; c++)
+		if(core_starts[c + 1] > core_starts[c])
+			fr->count++;
+
+	fr->starts = (long int *) malloc((fr->count + 1) * sizeof(long int));
+	fr->core_counts = (int *) malloc(fr->count * sizeof(int));
+	if(!fr->starts || !fr->core_counts)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for fragments.\n");
+
+	/* Neighbouring cores which can contain atoms of the buffer */
+	const int reach = (int) ceilf(buffer / size);
+
+	/* The first pass counts the atoms of the fragments, the second one stores them */
+	for(int pass = 0; pass < 2; pass++) {
+		int f = 0;
+		fr->starts[0] = 0;
+		for(int cz = 0; cz < dim[2]; cz++)
+		for(int cy = 0; cy < dim[1]; cy++)
+		for(int cx = 0; cx < dim[0]; cx++) {
+			const int c = (cz * dim[1] + cy) * dim[0] + cx;
+			if(core_starts[c + 1] == core_starts[c])
+				continue;
+
+			long int count = 0;
+			for(int j = core_starts[c]; j < core_starts[c + 1]; j++) {
+				if(pass == 1)
+					fr->idx[fr->starts[f] + count] = core_atoms[j];
+				count++;
+			}
+
+			/* Extended box of the fragment */
+			const float lo[3] = {min[0] + cx * size - buffer, min[1] + cy * size - buffer, min[2] + cz * size - buffer};
+			const float hi[3] = {lo[0] + size + 2 * buffer, lo[1] + size + 2 * buffer, lo[2] + size + 2 * buffer};
+
+			for(int nz = cz - reach; nz <= cz + reach; nz++)
+			for(int ny = cy - reach; ny <= cy + reach; ny++)
+			for(int nx = cx - reach; nx <= cx + reach; nx++) {
+				if(nx < 0 || ny < 0 || nz < 0 || nx >= dim[0] || ny >= dim[1] || nz >= dim[2])
+					continue;
+
+				const int nc = (nz * dim[1] + ny) * dim[0] + nx;
+				if(nc == c)
+					continue;
+
+				for(int j = core_starts[nc]; j < core_starts[nc + 1]; j++) {
+					const float * const p = m->atoms[core_atoms[j]].position;
+					if(p[0] < lo[0] || p[0] > hi[0] || p[1] < lo[1] || p[1] > hi[1] || p[2] < lo[2] || p[2] > hi[2])
+						continue;
+
+					if(pass == 1)
+						fr->idx[fr->starts[f] + count] = core_atoms[j];
+					count++;
+				}
+			}
+
+			if(pass == 0) {
+				fr->starts[f + 1] = fr->starts[f] + count;
+				fr->core_counts[f] = core_starts[c + 1] - core_starts[c];
+			}
+			f++;
+		}
+
+		if(pass == 0) {
+			fr->idx = (int *) malloc(fr->starts[fr->count] * sizeof(int));
+			if(!fr->idx)
+				EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for fragments.\n");
+		}
+	}
+
+	free(core);
+	free(core_starts);
+	free(core_atoms);
+}
+
+/* Destroy contents of the fragments */
+void fr_destroy(struct fragments * const fr) {
+
+	assert(fr != NULL);
+
+	free(fr->starts);
+	free(fr->core_counts);
+	free(fr->idx);
+}
@@ -0,0 +1,43 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAGMENTS_H__
+#define __FRAGMENTS_H__
+
+#include "structures.h"
+
+/* Compare with the dense solution for molecules up to this size in verbose mode */
+#define FRAGMENTS_CHECK_MAX_ATOMS 3000
+
+/* Spatial decomposition of a molecule into fragments. Atoms of fragment k are
+ * idx[starts[k]] ... idx[starts[k + 1] - 1]; the first core_counts[k] of them
+ * form its core, the rest is the buffer region around it. Each atom belongs
+ * to the core of exactly one fragment. */
+struct fragments {
+
+	int count;
+
+	long int *starts;
+	int *core_counts;
+	int *idx;
+};
+
+void fr_build(struct fragments * const fr, const struct molecule * const m, float size, float buffer);
+void fr_destroy(struct fragments * const fr);
+
+#endif /* __FRAGMENTS_H__ */
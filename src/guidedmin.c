@@ -118,14 +118,12 @@ int minimize_part_of_gm_set(struct subset* ss, int min_iterations) {
 			{
 				quite_good++;
 			}
-			struct kappa_data* m = (struct kappa_data *) malloc (sizeof(struct kappa_data));
-			kd_init(m);
+			struct kappa_data* m = kd_acquire();
 			m->parent_subset = ss;
 			kd_copy_parameters(&ss->data[i], m);
 			minimize_locally(m, min_iterations);
 			kd_copy_parameters(m, &ss->data[i]);
-			kd_destroy(m);
-			free(m);
+			kd_release(m);
 
 		}
 	}
@@ -429,12 +429,6 @@ static int load_molecule(FILE * const f, gzFile gz_f, struct molecule * const m)
 
 			sscanf(line, "%f %f %f %s", &m->atoms[i].position[0], &m->atoms[i].position[1], &m->atoms[i].position[2], atom_symbol);
 
-			if(s.mode == MODE_PARAMS) {
-				m->atoms[i].rdists = (double *) calloc(m->atoms_count, sizeof(double));
-				if(!m->atoms[i].rdists)
-					EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom distances.\n");
-			}
-
 			m->atoms[i].Z = convert_symbol_to_Z(atom_symbol);
 			if(m->atoms[i].Z == 0)
 				m->is_valid = 0;
@@ -568,12 +562,6 @@ static int load_molecule(FILE * const f, gzFile gz_f, struct molecule * const m)
 				}
 			}
 
-			if(s.mode == MODE_PARAMS) {
-				m->atoms[i].rdists = (double *) calloc(m->atoms_count, sizeof(double));
-				if(!m->atoms[i].rdists)
-					EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom distances.\n");
-			}
-
 			m->atoms[i].Z = convert_symbol_to_Z(atom_symbol);
 			if(m->atoms[i].Z == 0)
 				m->is_valid = 0;
@@ -645,6 +633,7 @@ static int load_molecule(FILE * const f, gzFile gz_f, struct molecule * const m)
 	m->sum_of_charges = (float) charges_sum;
 	m->has_charges = 0;
 	m->has_atom_types = 0;
+	m->rdists_offset = -1;
 	/* Assume that we have parameters, change to zero if that's not the case
 	 * (it's easier than the other way around) */
 	m->has_parameters = 1;
@@ -718,7 +707,7 @@ void output_charges_stats(const struct subset * const ss) {
 		for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
 			#define ATOM ts.molecules[i].atoms[j]
 			char buff[10];
-			at_format_text(&ts.atom_types[get_atom_type_idx(&ts.molecules[i].atoms[j])], buff);
+			at_format_text(&ts.atom_types[ts.atom_type_idx[atoms_processed + j]], buff);
 			fprintf(f, "%4d\t%-10s%9.6f\t%9.6f\t%9.6f\n", j + 1, buff,
 				ATOM.reference_charge, ss->best->charges[atoms_processed + j], ATOM.reference_charge - ss->best->charges[atoms_processed + j]);
 			#undef ATOM
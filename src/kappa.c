@@ -20,6 +20,8 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <omp.h>
 
 #include "eem.h"
 #include "kappa.h"
@@ -36,8 +38,11 @@ extern const struct training_set ts;
 extern const struct settings s;
 
 static void full_scan(struct subset * const ss);
+static void full_sweep(struct subset * const ss);
 static void brent(struct subset * const ss);
 static void perform_calculations(struct subset * const ss, struct kappa_data * const kd);
+static void keep_if_better(struct subset * const ss, const struct kappa_data * const kd, int * const kept);
+static int compare_kappa(const void *p1, const void *p2);
 
 /* Perform all three steps for one value of kappa */
 static void perform_calculations(struct subset * const ss, struct kappa_data * const kd) {
@@ -46,8 +51,56 @@ static void perform_calculations(struct subset * const ss, struct kappa_data * c
 	assert(kd != NULL);
 
 	calculate_parameters(ss, kd);
-	calculate_charges(ss, kd);
-	calculate_statistics(ss, kd);
+	if(s.fused_stats)
+		calculate_charges_and_statistics(ss, kd);
+	else {
+		calculate_charges(ss, kd);
+		calculate_statistics(ss, kd);
+	}
+}
+
+/* Copy kd among the kept kappa_data if there is still room for it or if it is better
+ * than the worst one kept so far */
+static void keep_if_better(struct subset * const ss, const struct kappa_data * const kd, int * const kept) {
+
+	assert(ss != NULL);
+	assert(kd != NULL);
+	assert(kept != NULL);
+
+	/* The last item is reserved for Brent */
+	const int capacity = ss->kappa_data_count - 1;
+
+	int slot;
+	if(*kept < capacity)
+		slot = (*kept)++;
+	else {
+		slot = 0;
+		for(int i = 1; i < capacity; i++)
+			if(kd_sort_by_is_better(&ss->data[slot], &ss->data[i]))
+				slot = i;
+
+		if(!kd_sort_by_is_better(kd, &ss->data[slot]))
+			return;
+	}
+
+	kd_copy(kd, &ss->data[slot]);
+}
+
+/* Compare two kappa_data by their kappa */
+static int compare_kappa(const void *p1, const void *p2) {
+
+	assert(p1 != NULL);
+	assert(p2 != NULL);
+
+	const float a = ((const struct kappa_data *) p1)->kappa;
+	const float b = ((const struct kappa_data *) p2)->kappa;
+
+	if(a > b)
+		return 1;
+	if(a < b)
+		return -1;
+
+	return 0;
 }
 
 /* Perform full scan */
@@ -55,16 +108,107 @@ static void full_scan(struct subset * const ss) {
 
 	assert(ss != NULL);
 
-	#pragma omp parallel for num_threads(s.max_threads)
-	for(int i = 0; i < ss->kappa_data_count - 1; i++) {
-		ss->data[i].kappa = i * s.full_scan_precision;
-		perform_calculations(ss, &ss->data[i]);
+	if(s.molecule_sweep) {
+		full_sweep(ss);
+		return;
+	}
+
+	int kept = 0;
+
+	#pragma omp parallel num_threads(s.max_threads)
+	{
+		/* Each thread scans a contiguous range of kappas, so the iterative
+		 * solver can start from the charges for the previous kappa */
+		const long int count = ss->scan_count;
+		const int first = (int) ((count * omp_get_thread_num()) / omp_get_num_threads());
+		const int last = (int) ((count * (omp_get_thread_num() + 1)) / omp_get_num_threads());
+
+		/* With --scan-keep, kappas are evaluated in a private kappa_data and only
+		 * the best ones are copied to ss->data */
+		struct kappa_data working;
+		if(s.scan_keep)
+			kd_init(&working);
+
+		for(int i = first; i < last; i++) {
+			struct kappa_data * const kd = s.scan_keep ? &working : &ss->data[i];
+
+			kd->kappa = i * s.full_scan_precision;
+			if((s.eem_solver == SOLVER_MINRES || s.eem_solver == SOLVER_AUTO) && !s.fused_stats && !s.scan_keep && i > first)
+				memcpy(kd->charges, ss->data[i - 1].charges, ts.atoms_count * sizeof(float));
+
+			perform_calculations(ss, kd);
+
+			ss->scan[i].kappa = kd->kappa;
+			ss->scan[i].full_stats = kd->full_stats;
+
+			if(s.scan_keep) {
+				#pragma omp critical
+				keep_if_better(ss, kd, &kept);
+			}
+
+			if(s.verbosity >= VERBOSE_KAPPA) {
+				printf("F> ");
+				kd_print_stats(kd);
+			}
+		}
+
+		if(s.scan_keep)
+			kd_destroy(&working);
+	}
+
+	/* Order the kept ones as if all of them were kept, so ties are resolved the same way */
+	if(s.scan_keep)
+		qsort(ss->data, kept, sizeof(struct kappa_data), compare_kappa);
+}
+
+/* Perform full scan with the molecules in the outer loop; the parameters of all
+ * kappas are known beforehand, so each molecule is solved for all of them in turn */
+static void full_sweep(struct subset * const ss) {
+
+	assert(ss != NULL);
+
+	const int count = ss->scan_count;
+
+	/* With --scan-keep, ss->data has no room for all kappas, so they are evaluated
+	 * in private kappa_data and only the best ones are copied there */
+	struct kappa_data *kds = ss->data;
+	if(s.scan_keep) {
+		kds = (struct kappa_data *) calloc(count, sizeof(struct kappa_data));
+		if(!kds)
+			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for kappa data array.\n");
+
+		for(int i = 0; i < count; i++)
+			kd_init(&kds[i]);
+	}
+
+	for(int i = 0; i < count; i++) {
+		kds[i].kappa = i * s.full_scan_precision;
+		calculate_parameters(ss, &kds[i]);
+	}
+
+	calculate_charges_and_statistics_sweep(ss, kds, count);
+
+	int kept = 0;
+	for(int i = 0; i < count; i++) {
+		ss->scan[i].kappa = kds[i].kappa;
+		ss->scan[i].full_stats = kds[i].full_stats;
+
+		if(s.scan_keep)
+			keep_if_better(ss, &kds[i], &kept);
 
 		if(s.verbosity >= VERBOSE_KAPPA) {
 			printf("F> ");
-			kd_print_stats(&ss->data[i]);
+			kd_print_stats(&kds[i]);
 		}
 	}
+
+	if(s.scan_keep) {
+		qsort(ss->data, kept, sizeof(struct kappa_data), compare_kappa);
+
+		for(int i = 0; i < count; i++)
+			kd_destroy(&kds[i]);
+		free(kds);
+	}
 }
 
 /* Run full scan followed by the Brent's method to polish the result;
@@ -75,13 +219,13 @@ static void brent(struct subset * const ss) {
 
 	full_scan(ss);
 
-	if(ss->kappa_data_count < 3)
+	if(ss->scan_count < 2)
 		EXIT_ERROR(RUN_ERROR, "%s", "Cannot determine the initial inverval for the Brent's method.\n");
 
 	/* Find the best so far */
 	int best_idx = 0;
-	for(int i = 1; i < ss->kappa_data_count - 1; i++)
-		if(ss->data[i].full_stats.R > ss->data[best_idx].full_stats.R)
+	for(int i = 1; i < ss->scan_count; i++)
+		if(ss->scan[i].full_stats.R > ss->scan[best_idx].full_stats.R)
 			best_idx = i;
 
 	/* Create initial inverval for Brent */
@@ -92,9 +236,9 @@ static void brent(struct subset * const ss) {
 	if(best_idx == 0) {
 		left_idx = 0;
 		right_idx = 1;
-	} else if(best_idx == ss->kappa_data_count - 2) {
-		left_idx = ss->kappa_data_count - 3;
-		right_idx = ss->kappa_data_count - 2;
+	} else if(best_idx == ss->scan_count - 1) {
+		left_idx = ss->scan_count - 2;
+		right_idx = ss->scan_count - 1;
 	}
 	else {
 		left_idx = best_idx - 1;
@@ -111,8 +255,8 @@ static void brent(struct subset * const ss) {
 	#define KAPPA_DATA_BRENT ss->data[ss->kappa_data_count - 1]
 
 	/* Initial interval values */
-	float a = ss->data[left_idx].kappa;
-	float b = ss->data[right_idx].kappa;
+	float a = ss->scan[left_idx].kappa;
+	float b = ss->scan[right_idx].kappa;
 
 	/* Abscissa */
 	float x, w, v, u;
@@ -128,6 +272,15 @@ static void brent(struct subset * const ss) {
 
 	x = w = v = 0.5f * (a + b);
 
+	/* Start the iterative solver from the charges of the best kappa so far, which
+	 * need not be kept with --scan-keep */
+	if((s.eem_solver == SOLVER_MINRES || s.eem_solver == SOLVER_AUTO) && !s.fused_stats)
+		for(int i = 0; i < ss->kappa_data_count - 1; i++)
+			if(ss->data[i].kappa == ss->scan[best_idx].kappa) {
+				memcpy(KAPPA_DATA_BRENT.charges, ss->data[i].charges, ts.atoms_count * sizeof(float));
+				break;
+			}
+
 	KAPPA_DATA_BRENT.kappa = x;
 	perform_calculations(ss, &KAPPA_DATA_BRENT);
 	/* The code is for minimization, so take the negative of R */
@@ -219,6 +372,11 @@ void find_the_best_parameters_for_subset(struct subset * const ss) {
 
 	assert(ss != NULL);
 
+	/* The fit of the parameters depends on kappa only through these; discarding
+	 * updates them from the parent subset beforehand */
+	if(ss->moments == NULL)
+		calculate_moments(ss);
+
 	if(s.kappa_set > 1e-10) {
 		fill_ss(ss, 1);
 		ss->data[0].kappa = s.kappa_set;
@@ -229,7 +387,15 @@ void find_the_best_parameters_for_subset(struct subset * const ss) {
 	else {
 		/* The last item in ss->data array is reserved for Brent whether it's used or not */
 		if (s.params_method == PARAMS_LR_FULL || s.params_method == PARAMS_LR_FULL_BRENT) {
-			fill_ss(ss, 1 + (int) (s.kappa_max / s.full_scan_precision));
+			ss->scan_count = (int) (s.kappa_max / s.full_scan_precision);
+			ss->scan = (struct kappa_stats *) calloc(ss->scan_count, sizeof(struct kappa_stats));
+			if(!ss->scan)
+				EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for full scan statistics.\n");
+
+			if(s.scan_keep && s.scan_keep < ss->scan_count)
+				fill_ss(ss, 1 + s.scan_keep);
+			else
+				fill_ss(ss, 1 + ss->scan_count);
 
 			if(s.params_method == PARAMS_LR_FULL)
 				full_scan(ss);
@@ -260,6 +426,14 @@ void find_the_best_parameters_for_subset(struct subset * const ss) {
 		}
 
 	}
+
+	/* Only the statistics were kept during the search, so get the charges of the best
+	 * parameters; the statistics are recalculated from them exactly */
+	if(s.fused_stats) {
+		kd_alloc_charges(ss->best);
+		calculate_charges(ss, ss->best);
+		calculate_statistics(ss, ss->best);
+	}
 }
 
 /* Set the best parameters from subset */
@@ -272,3 +446,36 @@ void set_the_best(struct subset * const ss) {
 		if(kd_sort_by_is_better(&ss->data[i], ss->best))
 			ss->best = &ss->data[i];
 }
+
+/* Scan kappa as the full scan does with the moments of ss already calculated, but
+ * solve and select it by the molecules of ss only and keep only the best kappa_data;
+ * meant for fitting many subsets concurrently, one per thread */
+void scan_kappa_for_subset(struct subset * const ss, struct kappa_data * const best) {
+
+	assert(ss != NULL);
+	assert(ss->moments != NULL);
+	assert(best != NULL);
+
+	const int count = s.kappa_set > 1e-10 ? 1 : (int) (s.kappa_max / s.full_scan_precision);
+
+	/* The charges are needed even with fused statistics */
+	struct kappa_data kd;
+	kd_init(&kd);
+	if(kd.charges == NULL)
+		kd_alloc_charges(&kd);
+	if(best->charges == NULL)
+		kd_alloc_charges(best);
+
+	for(int i = 0; i < count; i++) {
+		kd.kappa = s.kappa_set > 1e-10 ? s.kappa_set : i * s.full_scan_precision;
+
+		calculate_parameters(ss, &kd);
+		calculate_charges_for_subset(ss, &kd);
+		calculate_statistics_for_subset(ss, &kd);
+
+		if(i == 0 || kd_sort_by_is_better(&kd, best))
+			kd_copy(&kd, best);
+	}
+
+	kd_destroy(&kd);
+}
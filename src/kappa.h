@@ -23,5 +23,6 @@
 
 void find_the_best_parameters_for_subset(struct subset * const ss);
 void set_the_best(struct subset * const ss);
+void scan_kappa_for_subset(struct subset * const ss, struct kappa_data * const best);
 
 #endif /* __KAPPA_H__ */
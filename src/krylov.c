@@ -0,0 +1,295 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "krylov.h"
+
+static double dot(int n, const double * const x, const double * const y);
+static void apply_preconditioner(int n, const double * const minv, const double * const x, double * const y);
+
+/* Return the dot product of two vectors */
+static double dot(int n, const double * const x, const double * const y) {
+
+	double sum = 0.0;
+	for(int i = 0; i < n; i++)
+		sum += x[i] * y[i];
+
+	return sum;
+}
+
+/* Apply diagonal preconditioner (inverse of its diagonal is stored in minv) */
+static void apply_preconditioner(int n, const double * const minv, const double * const x, double * const y) {
+
+	if(minv == NULL)
+		memcpy(y, x, n * sizeof(double));
+	else
+		for(int i = 0; i < n; i++)
+			y[i] = minv[i] * x[i];
+}
+
+/* Solve symmetric, possibly indefinite, system A * x = b by preconditioned MINRES
+ * (Paige & Saunders). On input, x holds the initial guess. The preconditioner has
+ * to be positive definite. Iteration stops when the preconditioned residual norm
+ * drops below tol times the preconditioned norm of b. Return 0 on convergence. */
+int minres(int n, krylov_matvec matvec, const void * const ctx, const double * const b, double * const x,
+	   const double * const minv, double tol, int max_iters, int * const iters, double * const work) {
+
+	assert(matvec != NULL);
+	assert(b != NULL);
+	assert(x != NULL);
+	assert(iters != NULL);
+	assert(work != NULL);
+
+	double * const r1 = work;
+	double * const r2 = work + n;
+	double * const y = work + 2 * n;
+	double * const v = work + 3 * n;
+	double * const w = work + 4 * n;
+	double * const w1 = work + 5 * n;
+	double * const w2 = work + 6 * n;
+
+	*iters = 0;
+
+	/* Preconditioned norm of the right-hand side for the stopping criterion */
+	apply_preconditioner(n, minv, b, y);
+	const double bnorm = sqrt(dot(n, b, y));
+	if(bnorm == 0.0) {
+		for(int i = 0; i < n; i++)
+			x[i] = 0.0;
+		return 0;
+	}
+
+	/* Initial residual */
+	matvec(ctx, x, y);
+	for(int i = 0; i < n; i++)
+		r1[i] = b[i] - y[i];
+
+	apply_preconditioner(n, minv, r1, y);
+	double beta1 = dot(n, r1, y);
+	if(beta1 < 0.0)
+		return 1;
+
+	beta1 = sqrt(beta1);
+	if(beta1 <= tol * bnorm)
+		return 0;
+
+	memcpy(r2, r1, n * sizeof(double));
+	for(int i = 0; i < n; i++)
+		w[i] = w2[i] = 0.0;
+
+	double oldb = 0.0;
+	double beta = beta1;
+	double dbar = 0.0;
+	double epsln = 0.0;
+	double phibar = beta1;
+	double cs = -1.0;
+	double sn = 0.0;
+
+	for(int itn = 1; itn <= max_iters; itn++) {
+		*iters = itn;
+
+		/* Lanczos step */
+		const double scale = 1.0 / beta;
+		for(int i = 0; i < n; i++)
+			v[i] = scale * y[i];
+
+		matvec(ctx, v, y);
+		if(itn >= 2)
+			for(int i = 0; i < n; i++)
+				y[i] -= (beta / oldb) * r1[i];
+
+		const double alfa = dot(n, v, y);
+		for(int i = 0; i < n; i++)
+			y[i] -= (alfa / beta) * r2[i];
+
+		memcpy(r1, r2, n * sizeof(double));
+		memcpy(r2, y, n * sizeof(double));
+		apply_preconditioner(n, minv, r2, y);
+
+		oldb = beta;
+		beta = dot(n, r2, y);
+		if(beta < 0.0)
+			return 1;
+		beta = sqrt(beta);
+
+		/* Apply previous rotation and compute the new one */
+		const double oldeps = epsln;
+		const double delta = cs * dbar + sn * alfa;
+		const double gbar = sn * dbar - cs * alfa;
+		epsln = sn * beta;
+		dbar = - cs * beta;
+
+		double gamma = hypot(gbar, beta);
+		if(gamma < DBL_EPSILON)
+			gamma = DBL_EPSILON;
+
+		cs = gbar / gamma;
+		sn = beta / gamma;
+		const double phi = cs * phibar;
+		phibar = sn * phibar;
+
+		/* Update the solution */
+		const double denom = 1.0 / gamma;
+		for(int i = 0; i < n; i++) {
+			w1[i] = w2[i];
+			w2[i] = w[i];
+			w[i] = (v[i] - oldeps * w1[i] - delta * w2[i]) * denom;
+			x[i] += phi * w[i];
+		}
+
+		if(phibar <= tol * bnorm || beta == 0.0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Solve general system A * x = b by restarted GMRES(restart) with right diagonal
+ * preconditioning (inverse of its diagonal is stored in minv, may be NULL). On input,
+ * x holds the initial guess. Iteration stops when the residual norm drops below
+ * tol times the norm of b. Return 0 on convergence. */
+int gmres(int n, krylov_matvec matvec, const void * const ctx, const double * const b, double * const x,
+	  const double * const minv, double tol, int max_iters, int restart, int * const iters, double * const work) {
+
+	assert(matvec != NULL);
+	assert(b != NULL);
+	assert(x != NULL);
+	assert(iters != NULL);
+	assert(work != NULL);
+	assert(restart > 0);
+
+	const int m = restart;
+	double * const V = work;
+	double * const z = V + (long int) (m + 1) * n;
+	double * const H = z + n;
+	double * const cs = H + (long int) (m + 1) * m;
+	double * const sn = cs + m;
+	double * const g = sn + m;
+	double * const y = g + m + 1;
+
+	#define H_IDX(i, j) ((long int) (j) * (m + 1) + (i))
+
+	*iters = 0;
+
+	const double bnorm = sqrt(dot(n, b, b));
+	if(bnorm == 0.0) {
+		for(int i = 0; i < n; i++)
+			x[i] = 0.0;
+		return 0;
+	}
+
+	for(;;) {
+		/* Residual of the current solution */
+		matvec(ctx, x, V);
+		for(int i = 0; i < n; i++)
+			V[i] = b[i] - V[i];
+
+		const double beta = sqrt(dot(n, V, V));
+		if(beta <= tol * bnorm)
+			return 0;
+
+		if(*iters >= max_iters)
+			return 1;
+
+		for(int i = 0; i < n; i++)
+			V[i] /= beta;
+
+		g[0] = beta;
+		for(int i = 1; i <= m; i++)
+			g[i] = 0.0;
+
+		double resid = beta;
+		int k = 0;
+		while(k < m && *iters < max_iters && resid > tol * bnorm) {
+			(*iters)++;
+
+			/* New Krylov vector orthogonalized by modified Gram-Schmidt */
+			double * const v = V + (long int) (k + 1) * n;
+			apply_preconditioner(n, minv, V + (long int) k * n, z);
+			matvec(ctx, z, v);
+
+			for(int i = 0; i <= k; i++) {
+				const double * const vi = V + (long int) i * n;
+				const double h = dot(n, v, vi);
+				H[H_IDX(i, k)] = h;
+				for(int l = 0; l < n; l++)
+					v[l] -= h * vi[l];
+			}
+
+			const double h = sqrt(dot(n, v, v));
+			H[H_IDX(k + 1, k)] = h;
+			if(h > 0.0)
+				for(int l = 0; l < n; l++)
+					v[l] /= h;
+
+			/* Apply previous rotations and compute the new one */
+			for(int i = 0; i < k; i++) {
+				const double t = cs[i] * H[H_IDX(i, k)] + sn[i] * H[H_IDX(i + 1, k)];
+				H[H_IDX(i + 1, k)] = - sn[i] * H[H_IDX(i, k)] + cs[i] * H[H_IDX(i + 1, k)];
+				H[H_IDX(i, k)] = t;
+			}
+
+			const double r = hypot(H[H_IDX(k, k)], H[H_IDX(k + 1, k)]);
+			if(r == 0.0)
+				return 1;
+
+			cs[k] = H[H_IDX(k, k)] / r;
+			sn[k] = H[H_IDX(k + 1, k)] / r;
+			H[H_IDX(k, k)] = r;
+			H[H_IDX(k + 1, k)] = 0.0;
+
+			g[k + 1] = - sn[k] * g[k];
+			g[k] = cs[k] * g[k];
+			resid = fabs(g[k + 1]);
+
+			k++;
+
+			if(h == 0.0)
+				break;
+		}
+
+		/* Solve the triangular system and update the solution */
+		for(int i = k - 1; i >= 0; i--) {
+			double sum = g[i];
+			for(int j = i + 1; j < k; j++)
+				sum -= H[H_IDX(i, j)] * y[j];
+			y[i] = sum / H[H_IDX(i, i)];
+		}
+
+		for(int l = 0; l < n; l++)
+			z[l] = 0.0;
+		for(int i = 0; i < k; i++) {
+			const double * const vi = V + (long int) i * n;
+			for(int l = 0; l < n; l++)
+				z[l] += y[i] * vi[l];
+		}
+
+		if(minv != NULL)
+			for(int l = 0; l < n; l++)
+				x[l] += minv[l] * z[l];
+		else
+			for(int l = 0; l < n; l++)
+				x[l] += z[l];
+	}
+
+	#undef H_IDX
+}
@@ -0,0 +1,38 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KRYLOV_H__
+#define __KRYLOV_H__
+
+/* Compute y = A * x for the operator of the system being solved */
+typedef void (*krylov_matvec)(const void * const ctx, const double * const x, double * const y);
+
+/* Number of doubles of the work array needed by minres() for a system of size n */
+#define MINRES_WORK_SIZE(n) (7 * (long int) (n))
+
+/* Number of doubles of the work array needed by gmres() for a system of size n
+ * restarted after m iterations */
+#define GMRES_WORK_SIZE(n, m) ((long int) ((m) + 2) * (n) + (long int) ((m) + 1) * (m) + 4 * (long int) (m) + 1)
+
+int minres(int n, krylov_matvec matvec, const void * const ctx, const double * const b, double * const x,
+	   const double * const minv, double tol, int max_iters, int * const iters, double * const work);
+
+int gmres(int n, krylov_matvec matvec, const void * const ctx, const double * const b, double * const x,
+	  const double * const minv, double tol, int max_iters, int restart, int * const iters, double * const work);
+
+#endif /* __KRYLOV_H__ */
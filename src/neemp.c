@@ -24,6 +24,8 @@
 #include <mkl.h>
 #endif /* USE_MKL */
 
+#include "bootstrap.h"
+#include "cv.h"
 #include "discard.h"
 #include "eem.h"
 #include "kappa.h"
@@ -67,6 +69,9 @@ int main(int argc, char **argv) {
 
 	l_init(&limits, s.limit_iters, s.limit_time);
 
+	if(s.eem_solver == SOLVER_AUTO)
+		eem_tune_solvers();
+
 	load_molecules();
 	if(s.at_customization == AT_CUSTOM_USER)
 		load_user_atom_types();
@@ -114,6 +119,9 @@ int main(int argc, char **argv) {
 			if(s.chg_out_file[0] != '\0')
 				output_charges(result);
 
+			if(s.bootstrap)
+				run_bootstrap(result);
+
 			if(result != &full) {
 				printf("\nFinal results after discarding:\n\n");
 				print_results(result);
@@ -195,6 +203,14 @@ int main(int argc, char **argv) {
 
 			break;
 		}
+		case MODE_CV:
+			load_charges();
+			preprocess_molecules();
+			discard_invalid_molecules_or_without_charges_or_parameters();
+			ts_info();
+
+			run_cross_validation();
+			break;
 		case MODE_INFO:
 			preprocess_molecules();
 			discard_invalid_molecules_or_without_charges_or_parameters();
@@ -231,6 +247,8 @@ int main(int argc, char **argv) {
 	}
 
 	ts_destroy();
+	eem_destroy_workspaces();
+	kd_pool_destroy();
 
 	#ifdef USE_MKL
 	mkl_free_buffers();
@@ -0,0 +1,161 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "neemp.h"
+#include "neighbours.h"
+
+/* Keep the number of grid cells proportional to the number of atoms */
+#define MAX_CELLS_PER_ATOM 8
+
+static int cell_coord(float x, float min, float cell_size, int dim);
+
+/* Return index of the cell along one axis */
+static int cell_coord(float x, float min, float cell_size, int dim) {
+
+	int c = (int) ((x - min) / cell_size);
+	if(c >= dim)
+		c = dim - 1;
+
+	return c;
+}
+
+/* Find all pairs of atoms closer than the cutoff using the cell grid */
+void nl_build(struct neighbour_list * const nl, const struct molecule * const m, float cutoff) {
+
+	assert(nl != NULL);
+	assert(m != NULL);
+	assert(cutoff > 0.0f);
+
+	const int n = m->atoms_count;
+	nl->atoms_count = n;
+
+	/* Bounding box of the molecule */
+	float min[3], max[3];
+	for(int k = 0; k < 3; k++)
+		min[k] = max[k] = m->atoms[0].position[k];
+
+	for(int i = 1; i < n; i++)
+		for(int k = 0; k < 3; k++) {
+			if(m->atoms[i].position[k] < min[k])
+				min[k] = m->atoms[i].position[k];
+			if(m->atoms[i].position[k] > max[k])
+				max[k] = m->atoms[i].position[k];
+		}
+
+	/* Cells must not be smaller than the cutoff, make them larger for sparse molecules */
+	float cell_size = cutoff;
+	int dim[3];
+	for(;;) {
+		long int cells = 1;
+		for(int k = 0; k < 3; k++) {
+			dim[k] = (int) ((max[k] - min[k]) / cell_size) + 1;
+			cells *= dim[k];
+		}
+
+		if(cells <= (long int) MAX_CELLS_PER_ATOM * n)
+			break;
+
+		cell_size *= 2.0f;
+	}
+
+	const int cells_count = dim[0] * dim[1] * dim[2];
+	int *head = (int *) malloc(cells_count * sizeof(int));
+	int *next = (int *) malloc(n * sizeof(int));
+	int *cell = (int *) malloc(3 * n * sizeof(int));
+	nl->starts = (long int *) malloc((n + 1) * sizeof(long int));
+	if(!head || !next || !cell || !nl->starts)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for neighbour list.\n");
+
+	for(int c = 0; c < cells_count; c++)
+		head[c] = -1;
+
+	/* Put atoms into cells */
+	for(int i = 0; i < n; i++) {
+		for(int k = 0; k < 3; k++)
+			cell[3 * i + k] = cell_coord(m->atoms[i].position[k], min[k], cell_size, dim[k]);
+
+		const int c = (cell[3 * i + 2] * dim[1] + cell[3 * i + 1]) * dim[0] + cell[3 * i];
+		next[i] = head[c];
+		head[c] = i;
+	}
+
+	const double cutoff2 = (double) cutoff * cutoff;
+
+	/* The first pass counts the neighbours, the second one stores them */
+	for(int pass = 0; pass < 2; pass++) {
+		nl->starts[0] = 0;
+		for(int i = 0; i < n; i++) {
+			long int count = 0;
+			const float * const pi = m->atoms[i].position;
+
+			for(int cz = cell[3 * i + 2] - 1; cz <= cell[3 * i + 2] + 1; cz++)
+			for(int cy = cell[3 * i + 1] - 1; cy <= cell[3 * i + 1] + 1; cy++)
+			for(int cx = cell[3 * i] - 1; cx <= cell[3 * i] + 1; cx++) {
+				if(cx < 0 || cy < 0 || cz < 0 || cx >= dim[0] || cy >= dim[1] || cz >= dim[2])
+					continue;
+
+				for(int j = head[(cz * dim[1] + cy) * dim[0] + cx]; j != -1; j = next[j]) {
+					if(j == i)
+						continue;
+
+					const float * const pj = m->atoms[j].position;
+					const double dx = pi[0] - pj[0];
+					const double dy = pi[1] - pj[1];
+					const double dz = pi[2] - pj[2];
+					const double d2 = dx * dx + dy * dy + dz * dz;
+					if(d2 >= cutoff2)
+						continue;
+
+					if(pass == 1) {
+						nl->idx[nl->starts[i] + count] = j;
+						nl->rdists[nl->starts[i] + count] = 1.0 / sqrt(d2);
+					}
+					count++;
+				}
+			}
+
+			if(pass == 0)
+				nl->starts[i + 1] = nl->starts[i] + count;
+		}
+
+		if(pass == 0) {
+			nl->idx = (int *) malloc(nl->starts[n] * sizeof(int));
+			nl->rdists = (double *) malloc(nl->starts[n] * sizeof(double));
+			if((!nl->idx || !nl->rdists) && nl->starts[n] > 0)
+				EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for neighbour list.\n");
+		}
+	}
+
+	free(head);
+	free(next);
+	free(cell);
+}
+
+/* Destroy contents of the neighbour list */
+void nl_destroy(struct neighbour_list * const nl) {
+
+	assert(nl != NULL);
+
+	free(nl->starts);
+	free(nl->idx);
+	free(nl->rdists);
+}
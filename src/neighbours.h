@@ -0,0 +1,41 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NEIGHBOURS_H__
+#define __NEIGHBOURS_H__
+
+#include "structures.h"
+
+/* Molecules up to this size are checked against the dense solver in verbose mode */
+#define CUTOFF_CHECK_MAX_ATOMS 3000
+
+/* Reciprocal distances of the pairs of atoms closer than the cutoff stored in the
+ * compressed row format; neighbours of atom i are idx[starts[i]] ... idx[starts[i + 1] - 1] */
+struct neighbour_list {
+
+	int atoms_count;
+
+	long int *starts;
+	int *idx;
+	double *rdists;
+};
+
+void nl_build(struct neighbour_list * const nl, const struct molecule * const m, float cutoff);
+void nl_destroy(struct neighbour_list * const nl);
+
+#endif /* __NEIGHBOURS_H__ */
@@ -18,13 +18,9 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
-#ifdef USE_MKL
-#include <mkl.h>
-#else
-extern void dgels_(const char* trans, const int *m, const int *n, const int *nrhs, double *a, const int *lda, double *b, const int *ldb, double *work, const int *lwork, int *info);
-#endif /* USE_MKL */
-
+#include "config.h"
 #include "neemp.h"
 #include "parameters.h"
 #include "structures.h"
@@ -32,6 +28,9 @@ extern void dgels_(const char* trans, const int *m, const int *n, const int *nrh
 extern struct training_set ts;
 
 static inline int is_molecule_enabled(const struct subset * const ss, int mol_idx);
+static inline int molecule_weight(const struct subset * const ss, int mol_idx);
+static void moments_add(struct at_moments * const mo, double q, double chi, double y);
+static void moments_remove(struct at_moments * const mo, double q, double chi, double y);
 
 static inline int is_molecule_enabled(const struct subset * const ss, int mol_idx) {
 
@@ -40,91 +39,169 @@ static inline int is_molecule_enabled(const struct subset * const ss, int mol_id
 	return b_get(&ss->molecules, mol_idx);
 }
 
-/* Calculate parameters for give kappa_data structure */
-void calculate_parameters(struct subset * const ss, struct kappa_data * const kd) {
+/* Number of times the molecule counts in the subset, see struct subset */
+static inline int molecule_weight(const struct subset * const ss, int mol_idx) {
 
 	assert(ss != NULL);
-	assert(kd != NULL);
 
+	if(!is_molecule_enabled(ss, mol_idx))
+		return 0;
+
+	return ss->weights != NULL ? ss->weights[mol_idx] : 1;
+}
+
+/* Calculate moments of the reference charges, electronegativities and y of each atom
+ * type over the enabled molecules, weighted for a bootstrap resample; they don't depend
+ * on kappa, so it's done once per subset */
+void calculate_moments(struct subset * const ss) {
+
+	assert(ss != NULL);
+
+	free(ss->moments);
+	ss->moments = (struct at_moments *) calloc(ts.atom_types_count, sizeof(struct at_moments));
+	if(!ss->moments)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom type moments.\n");
+	ss->moments_updates = 0;
+
+	#pragma omp parallel for schedule(dynamic)
 	for(int i = 0; i < ts.atom_types_count; i++) {
 		#define AT ts.atom_types[i]
-
-		#ifdef USE_MKL
-		double *A = (double *) mkl_malloc(2 * AT.atoms_count * sizeof(double), 64);
-		/* b has to have at least 2 elements since b[1] is used to store beta parameter.
-		 * If atoms_count is 1 (which is unlikely but possible) we would probably crash... */
-		double *b = (double *) mkl_malloc((1 + AT.atoms_count) * sizeof(double), 64);
-		#else
-		double *A = (double *) malloc(2 * AT.atoms_count * sizeof(double));
-		double *b = (double *) malloc((1 + AT.atoms_count) * sizeof(double));
-		#endif /* USE_MKL */
-
-		/* If some molecule is disabled, skip its atoms.
-		 * To avoid having empty (zero) rows, change the index so that all used atoms are
-		 * at the beginning. */
-		int disabled_count = 0;
-		for(int j = 0; j < AT.atoms_count;j++) {
-			#define MOLECULE ts.molecules[AT.atoms_molecule_idx[j]]
-			#define ATOM ts.molecules[AT.atoms_molecule_idx[j]].atoms[AT.atoms_atom_idx[j]]
-
-			if(is_molecule_enabled(ss, AT.atoms_molecule_idx[j])) {
-				A[j - disabled_count] = 1.0;
-				b[j - disabled_count] = MOLECULE.electronegativity - kd->kappa * ATOM.y;
-			} else
-				disabled_count++;
-
-			#undef ATOM
-			#undef MOLECULE
+		#define MOLECULE ts.molecules[AT.atoms_molecule_idx[j]]
+		struct at_moments * const mo = &ss->moments[i];
+
+		const int * const order = ts.type_order + ts.atom_type_starts[i];
+		const float * const reference = ts.type_reference_charge + ts.atom_type_starts[i];
+
+		/* Means first, the products are then summed around them to avoid cancellation */
+		double q_sum = 0.0;
+		double chi_sum = 0.0;
+		double y_sum = 0.0;
+		for(int j = 0; j < AT.atoms_count; j++) {
+			const int w = molecule_weight(ss, AT.atoms_molecule_idx[j]);
+			if(!w)
+				continue;
+
+			q_sum += w * reference[j];
+			chi_sum += w * MOLECULE.electronegativity;
+			y_sum += w * ts.y[order[j]];
+			mo->count += w;
 		}
 
-		int border = AT.atoms_count - disabled_count;
-		disabled_count = 0;
-
-		for(int j = 0; j < AT.atoms_count;j++) {
-			#define MOLECULE ts.molecules[AT.atoms_molecule_idx[j]]
-			#define ATOM ts.molecules[AT.atoms_molecule_idx[j]].atoms[AT.atoms_atom_idx[j]]
-			if(is_molecule_enabled(ss, AT.atoms_molecule_idx[j]))
-				A[border + j - disabled_count] = ATOM.reference_charge;
-			else
-				disabled_count++;
-			#undef ATOM
-			#undef MOLECULE
+		if(!mo->count)
+			continue;
+
+		mo->q_avg = q_sum / mo->count;
+		mo->chi_avg = chi_sum / mo->count;
+		mo->y_avg = y_sum / mo->count;
+
+		for(int j = 0; j < AT.atoms_count; j++) {
+			const int w = molecule_weight(ss, AT.atoms_molecule_idx[j]);
+			if(!w)
+				continue;
+
+			const double dq = w * (reference[j] - mo->q_avg);
+			mo->qq += dq * (reference[j] - mo->q_avg);
+			mo->q_chi += dq * (MOLECULE.electronegativity - mo->chi_avg);
+			mo->q_y += dq * (ts.y[order[j]] - mo->y_avg);
 		}
+		#undef MOLECULE
+		#undef AT
+	}
+}
+
+/* Add one atom to the moments of its atom type */
+static void moments_add(struct at_moments * const mo, double q, double chi, double y) {
+
+	assert(mo != NULL);
+
+	const double dq = q - mo->q_avg;
+
+	mo->count++;
+	mo->q_avg += dq / mo->count;
+	mo->chi_avg += (chi - mo->chi_avg) / mo->count;
+	mo->y_avg += (y - mo->y_avg) / mo->count;
+
+	mo->qq += dq * (q - mo->q_avg);
+	mo->q_chi += dq * (chi - mo->chi_avg);
+	mo->q_y += dq * (y - mo->y_avg);
+}
+
+/* Remove one atom from the moments of its atom type, the reverse of moments_add */
+static void moments_remove(struct at_moments * const mo, double q, double chi, double y) {
 
-		char trans = 'N';
-		int m = AT.atoms_count - disabled_count;
-		int n = 2;
-		int nrhs = 1;
-		int lda = m;
-		int ldb = m;
-		int info;
-
-		#ifdef USE_MKL
-		info = LAPACKE_dgels(LAPACK_COL_MAJOR, trans, m, n, nrhs, A, lda, b, ldb);
-		#else
-		int lwork = -1;
-		double work_opt;
-
-		/* Check for optimal value of lwork */
-		dgels_(&trans, &m, &n, &nrhs, A, &lda, b, &ldb, &work_opt, &lwork, &info);
-		lwork = (int) work_opt;
-		double work[lwork];
-		dgels_(&trans, &m, &n, &nrhs, A, &lda, b, &ldb, work, &lwork, &info);
-		#endif /* USE_MKL */
-
-		if(info)
+	assert(mo != NULL);
+
+	if(mo->count == 1) {
+		memset(mo, 0x0, sizeof(struct at_moments));
+		return;
+	}
+
+	const double q_avg = (mo->count * mo->q_avg - q) / (mo->count - 1);
+	const double dq = q - q_avg;
+
+	mo->qq -= dq * (q - mo->q_avg);
+	mo->q_chi -= dq * (chi - mo->chi_avg);
+	mo->q_y -= dq * (y - mo->y_avg);
+
+	mo->q_avg = q_avg;
+	mo->chi_avg = (mo->count * mo->chi_avg - chi) / (mo->count - 1);
+	mo->y_avg = (mo->count * mo->y_avg - y) / (mo->count - 1);
+	mo->count--;
+}
+
+/* Set moments of the subset from the ones of its parent which differs only in the
+ * molecule mol_idx; only the atoms of that molecule are added or removed */
+void update_moments(struct subset * const ss, int mol_idx) {
+
+	assert(ss != NULL);
+	assert(ss->weights == NULL);
+
+	/* Rounding errors pile up along the chain of updates, so start over once in a while */
+	if(ss->parent == NULL || ss->parent->moments == NULL || ss->parent->moments_updates >= MAX_MOMENTS_UPDATES) {
+		calculate_moments(ss);
+		return;
+	}
+
+	free(ss->moments);
+	ss->moments = (struct at_moments *) malloc(ts.atom_types_count * sizeof(struct at_moments));
+	if(!ss->moments)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom type moments.\n");
+
+	memcpy(ss->moments, ss->parent->moments, ts.atom_types_count * sizeof(struct at_moments));
+	ss->moments_updates = ss->parent->moments_updates + 1;
+
+	#define MOLECULE ts.molecules[mol_idx]
+	const int start = ts.molecule_starts[mol_idx];
+	const int enabled = is_molecule_enabled(ss, mol_idx);
+	for(int j = 0; j < MOLECULE.atoms_count; j++) {
+		struct at_moments * const mo = &ss->moments[ts.atom_type_idx[start + j]];
+		if(enabled)
+			moments_add(mo, ts.reference_charge[start + j], MOLECULE.electronegativity, ts.y[start + j]);
+		else
+			moments_remove(mo, ts.reference_charge[start + j], MOLECULE.electronegativity, ts.y[start + j]);
+	}
+	#undef MOLECULE
+}
+
+/* Calculate parameters for give kappa_data structure; each atom type is fitted by
+ * alpha + beta * q = electronegativity - kappa * y in the least squares sense */
+void calculate_parameters(struct subset * const ss, struct kappa_data * const kd) {
+
+	assert(ss != NULL);
+	assert(ss->moments != NULL);
+	assert(kd != NULL);
+
+	for(int i = 0; i < ts.atom_types_count; i++) {
+		const struct at_moments * const mo = &ss->moments[i];
+
+		/* Same condition as a rank deficient system in dgels */
+		if(mo->count < 2 || mo->qq == 0.0)
 			EXIT_ERROR(RUN_ERROR, "%s", "The least squares method failed.\n");
 
-		kd->parameters_alpha[i] = (float) b[0];
-		kd->parameters_beta[i] = (float) b[1];
-		#undef AT
+		const double beta = (mo->q_chi - kd->kappa * mo->q_y) / mo->qq;
+		const double alpha = mo->chi_avg - kd->kappa * mo->y_avg - beta * mo->q_avg;
 
-		#ifdef USE_MKL
-		mkl_free(A);
-		mkl_free(b);
-		#else
-		free(A);
-		free(b);
-		#endif /* USE_MKL */
+		kd->parameters_alpha[i] = (float) alpha;
+		kd->parameters_beta[i] = (float) beta;
 	}
 }
@@ -21,6 +21,23 @@
 
 #include "subset.h"
 
+/* Centered moments of the atoms of one atom type in the enabled molecules; with
+ * them, the least squares fit of alpha and beta is a closed form for any kappa */
+struct at_moments {
+
+	int count;
+
+	double q_avg;
+	double chi_avg;
+	double y_avg;
+
+	double qq;
+	double q_chi;
+	double q_y;
+};
+
+void calculate_moments(struct subset * const ss);
+void update_moments(struct subset * const ss, int mol_idx);
 void calculate_parameters(struct subset * const ss, struct kappa_data * const kd);
 
 #endif /* __PARAMATERS_H__ */
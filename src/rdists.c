@@ -0,0 +1,81 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif /* __AVX__ */
+
+#include "rdists.h"
+
+/* Copy atom positions of the molecule into separate arrays of x, y and z coordinates */
+void rd_positions(const struct molecule * const m, float * const x, float * const y, float * const z) {
+
+	assert(m != NULL);
+	assert(x != NULL && y != NULL && z != NULL);
+
+	for(int i = 0; i < m->atoms_count; i++) {
+		x[i] = m->atoms[i].position[0];
+		y[i] = m->atoms[i].position[1];
+		z[i] = m->atoms[i].position[2];
+	}
+}
+
+/* Compute scale / |r_i - r_j| for all i < j into out[i] from the coordinate arrays.
+ * The vector version uses the approximate reciprocal square root refined by one
+ * Newton step, which is as accurate as single precision. */
+void rd_column(const float * const x, const float * const y, const float * const z, int j, double scale, double * const out) {
+
+	assert(x != NULL && y != NULL && z != NULL);
+	assert(out != NULL);
+
+	int i = 0;
+
+	#ifdef __AVX__
+	const __m256 xj = _mm256_set1_ps(x[j]);
+	const __m256 yj = _mm256_set1_ps(y[j]);
+	const __m256 zj = _mm256_set1_ps(z[j]);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 three_halves = _mm256_set1_ps(1.5f);
+	const __m256d s = _mm256_set1_pd(scale);
+
+	for(; i + 8 <= j; i += 8) {
+		const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), xj);
+		const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), yj);
+		const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), zj);
+		const __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+		/* r = r * (1.5 - 0.5 * d2 * r * r) */
+		__m256 r = _mm256_rsqrt_ps(d2);
+		const __m256 t = _mm256_mul_ps(_mm256_mul_ps(half, d2), _mm256_mul_ps(r, r));
+		r = _mm256_mul_ps(r, _mm256_sub_ps(three_halves, t));
+
+		_mm256_storeu_pd(out + i, _mm256_mul_pd(s, _mm256_cvtps_pd(_mm256_castps256_ps128(r))));
+		_mm256_storeu_pd(out + i + 4, _mm256_mul_pd(s, _mm256_cvtps_pd(_mm256_extractf128_ps(r, 1))));
+	}
+	#endif /* __AVX__ */
+
+	for(; i < j; i++) {
+		const double dx = x[i] - x[j];
+		const double dy = y[i] - y[j];
+		const double dz = z[i] - z[j];
+		out[i] = scale / sqrt(dx * dx + dy * dy + dz * dz);
+	}
+}
@@ -0,0 +1,27 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RDISTS_H__
+#define __RDISTS_H__
+
+#include "structures.h"
+
+void rd_positions(const struct molecule * const m, float * const x, float * const y, float * const z);
+void rd_column(const float * const x, const float * const y, const float * const z, int j, double scale, double * const out);
+
+#endif /* __RDISTS_H__ */
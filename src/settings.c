@@ -19,11 +19,13 @@
 #include <assert.h>
 #include <getopt.h>
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "limits.h"
 #include "neemp.h"
 #include "settings.h"
+#include "tuning.h"
 #include "../externals/lhs/latin_random.h"
 
 extern struct settings s;
@@ -62,6 +64,24 @@ static struct option long_options[] = {
 	{"max-threads", required_argument, 0, 171},
 	{"list-omitted-molecules", no_argument, 0, 172},
 	{"extra-precise", no_argument, 0, 173},
+	{"eem-solver", required_argument, 0, 175},
+	{"solver-tolerance", required_argument, 0, 176},
+	{"solver-max-iters", required_argument, 0, 177},
+	{"mixed-precision", no_argument, 0, 178},
+	{"batched-solve", no_argument, 0, 179},
+	{"cutoff", required_argument, 0, 200},
+	{"treecode", required_argument, 0, 201},
+	{"fragment-size", required_argument, 0, 202},
+	{"fragment-buffer", required_argument, 0, 203},
+	{"tuning-file", required_argument, 0, 204},
+	{"rdist-memory-budget", required_argument, 0, 205},
+	{"fused-stats", no_argument, 0, 206},
+	{"scan-keep", required_argument, 0, 207},
+	{"spill-file", required_argument, 0, 208},
+	{"shm-name", required_argument, 0, 209},
+	{"molecule-sweep", no_argument, 0, 210},
+	{"folds", required_argument, 0, 211},
+	{"bootstrap", required_argument, 0, 212},
 	{"om-pop-size", required_argument, 0, 180},
 	{"de-f", required_argument, 0, 181},
 	{"de-cr", required_argument, 0, 182},
@@ -119,6 +139,30 @@ void s_init(void) {
 	s.max_threads = 1;
 	s.list_omitted_molecules = 0;
 	s.extra_precise = 0;
+	s.eem_solver = SOLVER_DIRECT;
+	s.solver_tolerance = 1e-6f;
+	s.solver_max_iters = 1000;
+	s.mixed_precision = 0;
+	s.batched_solve = 0;
+	s.cutoff = 0.0f;
+	s.treecode_theta = -1.0f;
+	s.fragment_size = 0.0f;
+	s.fragment_buffer = 6.0f;
+	s.rdist_memory_budget = -1.0f;
+	s.fused_stats = 0;
+	s.scan_keep = 0;
+	s.molecule_sweep = 0;
+	s.cv_folds = 0;
+	s.bootstrap = 0;
+	memset(s.spill_file, 0x0, MAX_PATH_LEN * sizeof(char));
+	memset(s.shm_name, 0x0, MAX_PATH_LEN * sizeof(char));
+
+	memset(s.tuning_file, 0x0, MAX_PATH_LEN * sizeof(char));
+	const char * const home = getenv("HOME");
+	if(home != NULL)
+		snprintf(s.tuning_file, MAX_PATH_LEN, "%s/%s", home, TUNING_FILE_NAME);
+	else
+		strncpy(s.tuning_file, TUNING_FILE_NAME, MAX_PATH_LEN - 1);
 }
 
 /* Prints help if --version is issued */
@@ -139,11 +183,28 @@ static void print_help(void) {
 	printf("  -h, --help			 display this help and exit\n");
 	printf("      --version			 display version information and exit\n");
 	printf("      --max-threads N		 use up to N threads to solve EEM system in parallel\n");
-	printf("  -m, --mode MODE		 set mode for the NEEMP. Valid choices are: info, params, charges, quality, cover (required)\n");
+	printf("  -m, --mode MODE		 set mode for the NEEMP. Valid choices are: info, params, charges, quality, cover, cv (required)\n");
 	printf("  -p, --params-method METHOD set optimization method used for calculation of parameters. Valid choices are: lr-full, lr-full-brent, de, gm (optional)\n");
 	printf("      --sdf-file FILE		 SDF file (required)\n");
 	printf("      --atom-types-by METHOD	 classify atoms according to the METHOD. Valid choices are: Element, ElemBond or User.\n");
 	printf("      --list-omitted-molecules	 list names of molecules for which we don't have charges or parameters loaded (mode dependent).\n");
+	printf("      --eem-solver METHOD	 solve EEM systems by METHOD. Valid choices are: direct (default), minres, full, auto.\n");
+	printf("      --tuning-file FILE	 table of the fastest solvers per system size used by auto solver (default ~/%s).\n", TUNING_FILE_NAME);
+	printf("      --solver-tolerance VALUE	 relative residual at which the iterative solver stops (default 1e-6).\n");
+	printf("      --solver-max-iters N	 maximum number of iterations of the iterative solver (default 1000).\n");
+	printf("      --mixed-precision		 factorize EEM matrix in single precision and refine the solution in double precision.\n");
+	printf("      --batched-solve		 solve EEM systems of molecules with the same number of atoms together.\n");
+	printf("      --cutoff RADIUS		 use shifted interactions of atoms closer than RADIUS only and sparse iterative solver (modes charges and quality only). Max |dq| on set01 is about 0.1 for 5, 0.05 for 7 and 0.02 for 10; -v prints the error per molecule.\n");
+	printf("      --treecode THETA		 evaluate interactions by octree treecode with opening angle THETA from [0; 1] inside GMRES (modes charges and quality only). Molecules up to 128 atoms are summed directly; for larger ones max |dq| is about 0.04 for 0.5, 0.01 for 0.3 and 1e-3 for 0.1. Use 0.3, or 0.1 if accuracy matters; -v prints the error per molecule.\n");
+	printf("      --fragment-size SIZE	 split molecules into cubic fragments with edge SIZE solved separately (modes charges and quality only).\n");
+	printf("      --fragment-buffer WIDTH	 include atoms up to WIDTH around the fragment in its EEM system (default 6.0).\n");
+	printf("      --rdist-memory-budget MB	 cache reciprocal distances only up to MB megabytes, compute the rest on the fly (modes params and cv only).\n");
+	printf("      --fused-stats		 compute statistics while solving and keep charges only for the best parameters (methods lr-full and lr-full-brent only).\n");
+	printf("      --scan-keep K		 keep only K best kappa values of the full scan in memory (methods lr-full and lr-full-brent only).\n");
+	printf("      --molecule-sweep		 solve each molecule for all kappas of the full scan at once, implies --fused-stats (methods lr-full and lr-full-brent only).\n");
+	printf("      --spill-file FILE		 keep reciprocal distances in FILE mapped to memory instead of RAM (modes params and cv only).\n");
+	printf("      --shm-name NAME		 share reciprocal distances with other processes on the same input through shared memory segment NAME (modes params and cv only).\n");
+	printf("				 The segment stays in the system for later runs; remove it by 'rm /dev/shmNAME' to reuse NAME for another input or after a killed run.\n");
 	printf("Options specific to mode: params using linear regression as calculation method\n");
 	printf("      --chg-file FILE            FILE with ab-initio charges (required)\n");
 	printf("      --chg-stats-out-file FILE  output charges statistics to the FILE\n");
@@ -152,6 +213,7 @@ static void print_help(void) {
 	printf("      --kappa VALUE              use only one kappa VALUE for parameterization\n");
 	printf("      --fs-precision VALUE       resolution for the full scan (required)\n");
 	printf("      --kappa-preset PRESET      set kappa-max and fs-precision to safe values. Valid choices are: small, protein.\n");
+	printf("      --bootstrap N              fit parameters also on N resamples of the molecules and report their mean, stddev and percentiles (method lr-full only).\n");
 	printf("Options specific to mode: params using optimization method (differential evolution, guided minimization)\n");
 	printf("      --om-pop-size VALUE        set population size for optimization method (optional).\n");
 	printf("      --om-iters COUNT  	     set the maximum number of iterations for optimization method (optional).\n");
@@ -175,6 +237,8 @@ static void print_help(void) {
 	printf("Options specific to mode: charges\n");
 	printf("      --par-file FILE		 FILE with EEM parameters (required)\n");
 	printf("      --chg-out-file FILE	 Output charges to the FILE (required)\n");
+	printf("Options specific to mode: cv (also uses the options of method lr-full)\n");
+	printf("      --folds K			 split molecules into K folds at random, fit parameters without each of them and validate on it (default 5).\n");
 
 	printf("\nExamples:\n");
 	printf("neemp -m info --sdf-file molecules.sdf --atom-types-by Element\n\
@@ -214,6 +278,8 @@ void parse_options(int argc, char **argv) {
 					s.mode = MODE_QUALITY;
 				else if (!strcmp(optarg, "cover"))
 					s.mode = MODE_COVER;
+				else if (!strcmp(optarg, "cv"))
+					s.mode = MODE_CV;
 				else
 					EXIT_ERROR(ARG_ERROR, "Invalid mode: %s\n", optarg);
 				break;
@@ -373,6 +439,81 @@ void parse_options(int argc, char **argv) {
 			case 173:
 					 s.extra_precise = 1;
 					 break;
+			case 175:
+					 if(!strcmp(optarg, "direct"))
+						 s.eem_solver = SOLVER_DIRECT;
+					 else if(!strcmp(optarg, "minres"))
+						 s.eem_solver = SOLVER_MINRES;
+					 else if(!strcmp(optarg, "full"))
+						 s.eem_solver = SOLVER_FULL;
+					 else if(!strcmp(optarg, "auto"))
+						 s.eem_solver = SOLVER_AUTO;
+					 else
+						 EXIT_ERROR(ARG_ERROR, "Invalid eem-solver value: %s\n", optarg);
+					 break;
+			case 176:
+					 s.solver_tolerance = (float) atof(optarg);
+					 break;
+			case 177:
+					 s.solver_max_iters = atoi(optarg);
+					 break;
+			case 178:
+					 s.mixed_precision = 1;
+					 break;
+			case 179:
+					 s.batched_solve = 1;
+					 break;
+			case 200:
+					 s.cutoff = (float) atof(optarg);
+					 break;
+			case 201:
+					 s.treecode_theta = (float) atof(optarg);
+					 if(s.treecode_theta < 0.0f)
+						 EXIT_ERROR(ARG_ERROR, "Invalid treecode value: %s\n", optarg);
+					 break;
+			case 202:
+					 s.fragment_size = (float) atof(optarg);
+					 break;
+			case 203:
+					 s.fragment_buffer = (float) atof(optarg);
+					 break;
+			case 204:
+					 strncpy(s.tuning_file, optarg, MAX_PATH_LEN - 1);
+					 break;
+			case 205:
+					 s.rdist_memory_budget = (float) atof(optarg);
+					 if(s.rdist_memory_budget < 0.0f)
+						 EXIT_ERROR(ARG_ERROR, "Invalid rdist-memory-budget value: %s\n", optarg);
+					 break;
+			case 206:
+					 s.fused_stats = 1;
+					 break;
+			case 207:
+					 s.scan_keep = atoi(optarg);
+					 if(s.scan_keep < 1)
+						 EXIT_ERROR(ARG_ERROR, "Invalid scan-keep value: %s\n", optarg);
+					 break;
+			case 210:
+					 s.molecule_sweep = 1;
+					 break;
+			case 211:
+					 s.cv_folds = atoi(optarg);
+					 if(s.cv_folds < 2)
+						 EXIT_ERROR(ARG_ERROR, "Invalid folds value: %s\n", optarg);
+					 break;
+			case 212:
+					 s.bootstrap = atoi(optarg);
+					 if(s.bootstrap < 1)
+						 EXIT_ERROR(ARG_ERROR, "Invalid bootstrap value: %s\n", optarg);
+					 break;
+			case 208:
+					 strncpy(s.spill_file, optarg, MAX_PATH_LEN - 1);
+					 break;
+			case 209:
+					 strncpy(s.shm_name, optarg, MAX_PATH_LEN - 1);
+					 if(s.shm_name[0] != '/' || strchr(s.shm_name + 1, '/') != NULL)
+						 EXIT_ERROR(ARG_ERROR, "Invalid shm-name value: %s (use /NAME)\n", optarg);
+					 break;
 			/* DE settings */
 			case 180:
 					 s.population_size = atoi(optarg);
@@ -437,7 +578,7 @@ void parse_options(int argc, char **argv) {
 void check_settings(void) {
 
 	if(s.mode == MODE_NOT_SET)
-		EXIT_ERROR(ARG_ERROR, "%s", "No mode set. Use '-m MODE', where MODE = info, params, quality, charges, cover.\n");
+		EXIT_ERROR(ARG_ERROR, "%s", "No mode set. Use '-m MODE', where MODE = info, params, quality, charges, cover, cv.\n");
 
 	if(s.sdf_file[0] == '\0')
 		EXIT_ERROR(ARG_ERROR, "%s", "No .sdf file provided. Use '--sdf-file FILE'.\n");
@@ -451,13 +592,121 @@ void check_settings(void) {
 	if(s.max_threads < s.om_threads)
 		EXIT_ERROR(ARG_ERROR, "%s", "Maximum number of OM threads has to be smaller than maximum number of threads.\n");
 
-	if(s.mode == MODE_PARAMS) {
+	if(s.eem_solver == SOLVER_MINRES || s.eem_solver == SOLVER_AUTO) {
+		if(s.solver_tolerance <= 0.0f || s.solver_tolerance >= 1.0f)
+			EXIT_ERROR(ARG_ERROR, "%s", "Solver tolerance has to be in range (0.0; 1.0).\n");
+
+		if(s.solver_max_iters < 1)
+			EXIT_ERROR(ARG_ERROR, "%s", "Maximum number of solver iterations has to be positive.\n");
+	}
+
+	if(s.eem_solver != SOLVER_DIRECT && s.extra_precise)
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --extra-precise can be used only with the direct EEM solver.\n");
+
+	if(s.mixed_precision && s.extra_precise)
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --mixed-precision cannot be combined with --extra-precise.\n");
+
+	if(s.mixed_precision && (s.eem_solver == SOLVER_FULL || s.eem_solver == SOLVER_AUTO))
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --mixed-precision can be used only with the direct and minres EEM solvers.\n");
+
+	if(s.batched_solve && (s.extra_precise || s.mixed_precision || s.eem_solver != SOLVER_DIRECT))
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --batched-solve can be used only with the default direct solver.\n");
+
+	if(s.cutoff < 0.0f)
+		EXIT_ERROR(ARG_ERROR, "%s", "Cutoff radius has to be positive.\n");
+
+	if(s.cutoff > 0.0f) {
+		if(s.mode != MODE_CHARGES && s.mode != MODE_QUALITY)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --cutoff can be used only in modes charges and quality.\n");
+
+		if(s.extra_precise || s.mixed_precision || s.batched_solve || s.eem_solver == SOLVER_FULL || s.eem_solver == SOLVER_AUTO)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --cutoff has its own solver and cannot be combined with other solver options.\n");
+	}
+
+	if(s.treecode_theta >= 0.0f) {
+		if(s.treecode_theta > 1.0f)
+			EXIT_ERROR(ARG_ERROR, "%s", "Treecode opening angle has to be in range [0.0; 1.0].\n");
+
+		if(s.mode != MODE_CHARGES && s.mode != MODE_QUALITY)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --treecode can be used only in modes charges and quality.\n");
+
+		if(s.extra_precise || s.mixed_precision || s.batched_solve || s.cutoff > 0.0f ||
+		   s.eem_solver == SOLVER_FULL || s.eem_solver == SOLVER_AUTO)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --treecode has its own solver and cannot be combined with other solver options.\n");
+	}
+
+	if(s.fragment_size < 0.0f)
+		EXIT_ERROR(ARG_ERROR, "%s", "Fragment size has to be positive.\n");
+
+	if(s.fragment_size > 0.0f) {
+		if(s.fragment_buffer < 0.0f)
+			EXIT_ERROR(ARG_ERROR, "%s", "Fragment buffer width cannot be negative.\n");
+
+		if(s.mode != MODE_CHARGES && s.mode != MODE_QUALITY)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --fragment-size can be used only in modes charges and quality.\n");
+
+		if(s.extra_precise || s.mixed_precision || s.batched_solve || s.eem_solver != SOLVER_DIRECT ||
+		   s.cutoff > 0.0f || s.treecode_theta >= 0.0f)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --fragment-size can be used only with the default direct solver.\n");
+	}
+
+	if(s.rdist_memory_budget >= 0.0f && s.mode != MODE_PARAMS && s.mode != MODE_CV)
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --rdist-memory-budget can be used only in modes params and cv.\n");
+
+	if(s.spill_file[0] != '\0' && s.mode != MODE_PARAMS && s.mode != MODE_CV)
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --spill-file can be used only in modes params and cv.\n");
+
+	if(s.shm_name[0] != '\0') {
+		if(s.mode != MODE_PARAMS && s.mode != MODE_CV)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --shm-name can be used only in modes params and cv.\n");
+
+		if(s.spill_file[0] != '\0')
+			EXIT_ERROR(ARG_ERROR, "%s", "Options --shm-name and --spill-file cannot be combined.\n");
+	}
+
+	if(s.molecule_sweep) {
+		if(s.mode != MODE_PARAMS || s.params_method == PARAMS_DE || s.params_method == PARAMS_GM || s.kappa_set > 1e-10)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --molecule-sweep can be used only in mode params with methods lr-full and lr-full-brent.\n");
+
+		/* The charges for all kappas don't fit in memory, only their statistics do */
+		s.fused_stats = 1;
+	}
+
+	if(s.fused_stats) {
+		if(s.mode != MODE_PARAMS || s.params_method == PARAMS_DE || s.params_method == PARAMS_GM)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --fused-stats can be used only in mode params with methods lr-full and lr-full-brent.\n");
+
+		if(s.batched_solve)
+			EXIT_ERROR(ARG_ERROR, "%s", "Option --fused-stats solves molecules one by one and cannot be combined with --batched-solve.\n");
+	}
+
+	if(s.scan_keep && (s.mode != MODE_PARAMS || s.params_method == PARAMS_DE || s.params_method == PARAMS_GM))
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --scan-keep can be used only in mode params with methods lr-full and lr-full-brent.\n");
+
+	if(s.cv_folds && s.mode != MODE_CV)
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --folds can be used only in mode cv.\n");
+
+	if(s.bootstrap && (s.mode != MODE_PARAMS || (s.params_method != PARAMS_LR_FULL && s.params_method != PARAMS_NOT_SET)))
+		EXIT_ERROR(ARG_ERROR, "%s", "Option --bootstrap can be used only in mode params with method lr-full.\n");
+
+	if(s.mode == MODE_PARAMS || s.mode == MODE_CV) {
 		if(s.chg_file[0] == '\0')
 			EXIT_ERROR(ARG_ERROR, "%s", "No .chg file provided. Use '--chg-file FILE'.\n");
 		/* If user did not specify the optimization method for parameters calculation, set linear regression */
 		if (s.params_method == PARAMS_NOT_SET)
 			s.params_method = PARAMS_LR_FULL;
 
+		if(s.mode == MODE_CV) {
+			if(s.params_method != PARAMS_LR_FULL)
+				EXIT_ERROR(ARG_ERROR, "%s", "Mode cv can be used only with method lr-full.\n");
+
+			if(s.discard != DISCARD_OFF)
+				EXIT_ERROR(ARG_ERROR, "%s", "Mode cv cannot be combined with discarding.\n");
+
+			if(s.cv_folds == 0)
+				s.cv_folds = 5;
+		}
+
 		if (s.params_method == PARAMS_LR_FULL || s.params_method == PARAMS_LR_FULL_BRENT) {
 			if(s.full_scan_precision < 0)
 				EXIT_ERROR(ARG_ERROR, "%s", "Full scan precision must greater than zero.\n");
@@ -553,6 +802,9 @@ void print_settings(void) {
 			if (s.params_method == PARAMS_DE)
 				printf(" with differential evolution method\n");
 			break;
+		case MODE_CV:
+			printf("cv (%d-fold cross-validation of EEM parameters)\n", s.cv_folds);
+			break;
 		case MODE_CHARGES:
 			printf("charges (calculate EEM charges)\n");
 			break;
@@ -601,6 +853,32 @@ void print_settings(void) {
     printf("\nMaximum number of threads: %d\n", s.max_threads);
 	if (s.mode == MODE_PARAMS && s.params_method == PARAMS_DE)
 		printf("Maximum number of threads used for DE: %d\n", s.om_threads);
+	if (s.eem_solver == SOLVER_MINRES)
+		printf("EEM solver: minres (tolerance %g, at most %d iterations)\n", s.solver_tolerance, s.solver_max_iters);
+	if (s.eem_solver == SOLVER_FULL)
+		printf("EEM solver: full (blocked factorization in full storage)\n");
+	if (s.eem_solver == SOLVER_AUTO)
+		printf("EEM solver: auto (tuning file %s)\n", s.tuning_file);
+	if (s.cutoff > 0.0f)
+		printf("Interaction cutoff: %g (shifted kernel, sparse minres, tolerance %g)\n", s.cutoff, s.solver_tolerance);
+	if (s.treecode_theta >= 0.0f)
+		printf("Treecode opening angle: %g (gmres, tolerance %g)\n", s.treecode_theta, s.solver_tolerance);
+	if (s.rdist_memory_budget >= 0.0f)
+		printf("Memory budget for reciprocal distances: %g MB\n", s.rdist_memory_budget);
+	if (s.spill_file[0] != '\0')
+		printf("Reciprocal distances spilled to %s\n", s.spill_file);
+	if (s.shm_name[0] != '\0')
+		printf("Reciprocal distances shared through segment %s\n", s.shm_name);
+	if (s.fused_stats)
+		printf("Statistics fused with the EEM solver\n");
+	if (s.scan_keep)
+		printf("Full scan keeps %d best kappa values\n", s.scan_keep);
+	if (s.molecule_sweep)
+		printf("Full scan sweeps all kappa values molecule by molecule\n");
+	if (s.bootstrap)
+		printf("Bootstrap resamples: %d\n", s.bootstrap);
+	if (s.fragment_size > 0.0f)
+		printf("Fragment size: %g (buffer %g)\n", s.fragment_size, s.fragment_buffer);
 	printf("\nVerbosity level: ");
 	switch(s.verbosity) {
 		case VERBOSE_MINIMAL:
@@ -617,7 +895,7 @@ void print_settings(void) {
 			break;
 	}
 
-	if(s.mode == MODE_PARAMS) {
+	if(s.mode == MODE_PARAMS || s.mode == MODE_CV) {
 		printf("\nSort by: ");
 		switch(s.sort_by) {
 			case SORT_R:
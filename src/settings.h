@@ -30,6 +30,7 @@ enum app_mode {
 	MODE_INFO,
 	MODE_QUALITY,
 	MODE_COVER,
+	MODE_CV,
 	MODE_NOT_SET
 };
 
@@ -68,6 +69,14 @@ enum discarding_mode {
 	DISCARD_SIMPLE
 };
 
+enum eem_solver {
+
+	SOLVER_DIRECT,
+	SOLVER_MINRES,
+	SOLVER_FULL,
+	SOLVER_AUTO
+};
+
 enum verbosity_levels {
 
 	VERBOSE_MINIMAL = 0,
@@ -129,6 +138,62 @@ struct settings {
 	int max_threads;
 
 	int extra_precise;
+
+	/* Method used to solve EEM systems; iterative ones are warm-started
+	 * from the charges already stored in the kappa_data */
+	enum eem_solver eem_solver;
+	float solver_tolerance;
+	int solver_max_iters;
+
+	/* Factorize EEM matrix in single precision and refine the solution in double */
+	int mixed_precision;
+
+	/* Solve EEM systems of equally sized molecules together, one per SIMD lane */
+	int batched_solve;
+
+	/* Neglect interactions of atoms farther apart than cutoff; 0 means no cutoff */
+	float cutoff;
+
+	/* Opening angle of the treecode used to evaluate kappa/r interactions;
+	 * negative if the treecode is not used */
+	float treecode_theta;
+
+	/* Edge of the cubic cores of the fragments solved separately and the width of
+	 * the buffer region around them; 0 means the molecules are not fragmented */
+	float fragment_size;
+	float fragment_buffer;
+
+	/* Memory for cached reciprocal distances in MB; negative means no limit */
+	float rdist_memory_budget;
+
+	/* Table of the fastest solver backends for --eem-solver auto */
+	char tuning_file[MAX_PATH_LEN];
+
+	/* Fold charges into the statistics as soon as a molecule is solved; charges
+	 * are then kept only for the best kappa_data */
+	int fused_stats;
+
+	/* Number of the best kappa_data kept by the full scan; 0 keeps all of them */
+	int scan_keep;
+
+	/* Solve each molecule for all kappas of the full scan before moving to the next
+	 * one instead of scanning kappas one by one; implies fused_stats */
+	int molecule_sweep;
+
+	/* Number of folds of mode cv */
+	int cv_folds;
+
+	/* Number of bootstrap resamples the parameters are fitted on after the full
+	 * set; 0 means no bootstrap */
+	int bootstrap;
+
+	/* File the reciprocal distances are mapped from instead of being kept in RAM;
+	 * empty if not used */
+	char spill_file[MAX_PATH_LEN];
+
+	/* POSIX shared memory segment the reciprocal distances are published to by the
+	 * first process and attached from by the others; empty if not used */
+	char shm_name[MAX_PATH_LEN];
 };
 
 void s_init(void);
@@ -0,0 +1,254 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "neemp.h"
+#include "settings.h"
+#include "shm.h"
+#include "structures.h"
+
+extern const struct settings s;
+extern struct training_set ts;
+
+#define SHM_MAGIC "NEEMPSHM"
+
+/* The segment holds the header, y of all atoms and the reciprocal distance arena */
+struct shm_header {
+
+	char magic[8];
+	volatile int ready;
+	int molecules_count;
+	int atoms_count;
+	int rdist_size;
+	long int rdists_count;
+	unsigned long int fingerprint;
+};
+
+static void *segment = NULL;
+static size_t segment_size = 0;
+
+/* Set while this process created the segment and has not published it yet */
+static int unpublished = 0;
+
+static unsigned long int ts_fingerprint(void);
+static size_t y_offset(void);
+static size_t rdists_offset(void);
+static void shm_remove_unpublished(void);
+static int is_abandoned(int fd);
+static void wait_for_creator(int fd, time_t start);
+
+/* FNV-1a hash of the atom positions and reference charges, so that processes
+ * working on different training sets don't share one segment by mistake */
+static unsigned long int ts_fingerprint(void) {
+
+	unsigned long int hash = 14695981039346656037UL;
+
+	for(int i = 0; i < ts.molecules_count; i++)
+		for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
+			#define ATOM ts.molecules[i].atoms[j]
+			const unsigned char *p = (const unsigned char *) ATOM.position;
+			for(size_t k = 0; k < sizeof(ATOM.position); k++)
+				hash = (hash ^ p[k]) * 1099511628211UL;
+
+			p = (const unsigned char *) &ATOM.reference_charge;
+			for(size_t k = 0; k < sizeof(ATOM.reference_charge); k++)
+				hash = (hash ^ p[k]) * 1099511628211UL;
+			#undef ATOM
+		}
+
+	return hash;
+}
+
+/* Offset of y in the segment */
+static size_t y_offset(void) {
+
+	return (sizeof(struct shm_header) + 63) & ~((size_t) 63);
+}
+
+/* Offset of the reciprocal distances in the segment */
+static size_t rdists_offset(void) {
+
+	return (y_offset() + ts.atoms_count * sizeof(double) + 63) & ~((size_t) 63);
+}
+
+/* Remove the segment if this process created it and exits before publishing it, so
+ * that the processes waiting for it fail at once and the next ones create it again */
+static void shm_remove_unpublished(void) {
+
+	if(unpublished)
+		shm_unlink(s.shm_name);
+}
+
+/* Check whether the segment open as fd was removed by its creator */
+static int is_abandoned(int fd) {
+
+	struct stat st, current;
+	if(fstat(fd, &st))
+		return 1;
+
+	const int current_fd = shm_open(s.shm_name, O_RDONLY, 0);
+	if(current_fd < 0)
+		return 1;
+
+	const int replaced = fstat(current_fd, &current) || current.st_ino != st.st_ino;
+	close(current_fd);
+
+	return replaced;
+}
+
+/* Check that the creator of the segment open as fd is still working on it */
+static void wait_for_creator(int fd, time_t start) {
+
+	if(is_abandoned(fd))
+		EXIT_ERROR(RUN_ERROR, "The process creating shared memory segment %s failed.\n", s.shm_name);
+
+	if(time(NULL) - start > SHM_WAIT_TIMEOUT)
+		EXIT_ERROR(RUN_ERROR, "Shared memory segment %s was not published in time. If its creator was killed, "
+			   "remove the segment by 'rm /dev/shm%s'.\n", s.shm_name, s.shm_name);
+
+	const struct timespec pause = {0, 10000000};
+	nanosleep(&pause, NULL);
+}
+
+/* Map the segment s.shm_name holding count reciprocal distances. If another process
+ * already published it, wait until it is complete and set published; otherwise
+ * create it and let the caller fill it and call shm_publish. */
+rdist_t *shm_map(long int count, int * const published) {
+
+	assert(published != NULL);
+
+	segment_size = rdists_offset() + count * sizeof(rdist_t);
+
+	const unsigned long int fingerprint = ts_fingerprint();
+
+	int fd = shm_open(s.shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if(fd >= 0) {
+		unpublished = 1;
+		atexit(shm_remove_unpublished);
+
+		if(ftruncate(fd, (off_t) segment_size))
+			EXIT_ERROR(IO_ERROR, "Cannot resize shared memory segment %s.\n", s.shm_name);
+
+		segment = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(segment == MAP_FAILED)
+			EXIT_ERROR(IO_ERROR, "Cannot map shared memory segment %s.\n", s.shm_name);
+
+		close(fd);
+
+		struct shm_header * const h = (struct shm_header *) segment;
+		memcpy(h->magic, SHM_MAGIC, sizeof(h->magic));
+		h->molecules_count = ts.molecules_count;
+		h->atoms_count = ts.atoms_count;
+		h->rdist_size = sizeof(rdist_t);
+		h->rdists_count = count;
+		h->fingerprint = fingerprint;
+
+		*published = 0;
+		return (rdist_t *) ((char *) segment + rdists_offset());
+	}
+
+	if(errno != EEXIST)
+		EXIT_ERROR(IO_ERROR, "Cannot create shared memory segment %s.\n", s.shm_name);
+
+	fd = shm_open(s.shm_name, O_RDONLY, 0);
+	if(fd < 0)
+		EXIT_ERROR(IO_ERROR, "Cannot open shared memory segment %s.\n", s.shm_name);
+
+	/* The creator might not have resized the segment yet */
+	struct stat st;
+	time_t start = time(NULL);
+	while(!fstat(fd, &st) && st.st_size == 0)
+		wait_for_creator(fd, start);
+
+	if((size_t) st.st_size != segment_size)
+		EXIT_ERROR(RUN_ERROR, "Shared memory segment %s holds a different training set. Use another name or "
+			   "remove the segment by 'rm /dev/shm%s'.\n", s.shm_name, s.shm_name);
+
+	segment = mmap(NULL, segment_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(segment == MAP_FAILED)
+		EXIT_ERROR(IO_ERROR, "Cannot map shared memory segment %s.\n", s.shm_name);
+
+	const struct shm_header * const h = (const struct shm_header *) segment;
+	while(!h->ready)
+		wait_for_creator(fd, start);
+	__sync_synchronize();
+
+	close(fd);
+
+	if(memcmp(h->magic, SHM_MAGIC, sizeof(h->magic)) || h->molecules_count != ts.molecules_count ||
+	   h->atoms_count != ts.atoms_count || h->rdist_size != sizeof(rdist_t) || h->rdists_count != count ||
+	   h->fingerprint != fingerprint)
+		EXIT_ERROR(RUN_ERROR, "Shared memory segment %s holds a different training set. Use another name or "
+			   "remove the segment by 'rm /dev/shm%s'.\n", s.shm_name, s.shm_name);
+
+	printf("\nReciprocal distances attached from shared memory segment %s\n", s.shm_name);
+
+	*published = 1;
+	return (rdist_t *) ((char *) segment + rdists_offset());
+}
+
+/* Store y of all atoms and mark the segment complete for other processes */
+void shm_publish(void) {
+
+	assert(segment != NULL);
+
+	double * const y = (double *) ((char *) segment + y_offset());
+	int k = 0;
+	for(int i = 0; i < ts.molecules_count; i++)
+		for(int j = 0; j < ts.molecules[i].atoms_count; j++)
+			y[k++] = ts.molecules[i].atoms[j].y;
+
+	__sync_synchronize();
+	((struct shm_header *) segment)->ready = 1;
+	unpublished = 0;
+
+	printf("\nReciprocal distances published to shared memory segment %s\n", s.shm_name);
+}
+
+/* Copy y of all atoms from the published segment */
+void shm_load_y(void) {
+
+	assert(segment != NULL);
+
+	const double * const y = (const double *) ((const char *) segment + y_offset());
+	int k = 0;
+	for(int i = 0; i < ts.molecules_count; i++)
+		for(int j = 0; j < ts.molecules[i].atoms_count; j++)
+			ts.molecules[i].atoms[j].y = y[k++];
+}
+
+/* Unmap the segment; it stays in the system for the next processes */
+void shm_unmap(void) {
+
+	if(segment == NULL)
+		return;
+
+	munmap(segment, segment_size);
+	segment = NULL;
+}
@@ -0,0 +1,32 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include "structures.h"
+
+/* How long to wait (in seconds) for another process to publish the segment */
+#define SHM_WAIT_TIMEOUT 600
+
+rdist_t *shm_map(long int count, int * const published);
+void shm_publish(void);
+void shm_load_y(void);
+void shm_unmap(void);
+
+#endif /* __SHM_H__ */
@@ -0,0 +1,186 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+
+#include "smallsolve.h"
+
+/* Define solver for symmetric system of fixed size N in full row-major storage.
+ * Only the upper triangle is referenced and updated; the matrix is factorized as
+ * U^T * D * U without pivoting and the solution overwrites b. Return 1 if a pivot
+ * is too small, so that the caller can use a pivoting solver instead. */
+#define DEFINE_SMALL_SOLVER(N) \
+static int small_solve_##N(double * restrict A, double * restrict b, double min_pivot) { \
+\
+	for(int k = 0; k < N; k++) { \
+		const double d = A[k * N + k]; \
+		if(!(fabs(d) > min_pivot)) \
+			return 1; \
+\
+		for(int i = k + 1; i < N; i++) { \
+			const double f = A[k * N + i] / d; \
+			if(f == 0.0) \
+				continue; \
+\
+			for(int j = i; j < N; j++) \
+				A[i * N + j] -= f * A[k * N + j]; \
+			b[i] -= f * b[k]; \
+		} \
+	} \
+\
+	for(int k = N - 1; k >= 0; k--) { \
+		double sum = b[k]; \
+		for(int j = k + 1; j < N; j++) \
+			sum -= A[k * N + j] * b[j]; \
+		b[k] = sum / A[k * N + k]; \
+	} \
+\
+	return 0; \
+}
+
+DEFINE_SMALL_SOLVER(16)
+DEFINE_SMALL_SOLVER(32)
+DEFINE_SMALL_SOLVER(48)
+DEFINE_SMALL_SOLVER(64)
+DEFINE_SMALL_SOLVER(80)
+DEFINE_SMALL_SOLVER(96)
+DEFINE_SMALL_SOLVER(112)
+DEFINE_SMALL_SOLVER(128)
+
+#undef DEFINE_SMALL_SOLVER
+
+/* Return size of the kernel able to solve system of size n or 0 if there is none */
+int small_solver_size(int n) {
+
+	if(n > SMALL_SOLVER_MAX_SIZE)
+		return 0;
+
+	return ((n + SMALL_SOLVER_STEP - 1) / SMALL_SOLVER_STEP) * SMALL_SOLVER_STEP;
+}
+
+/* Solve system stored in size * size matrix A (padded by identity if needed).
+ * Return 0 on success */
+int small_solve(double * const A, double * const b, int size) {
+
+	assert(A != NULL);
+	assert(b != NULL);
+
+	double amax = 0.0;
+	for(int i = 0; i < size; i++)
+		for(int j = i; j < size; j++)
+			if(fabs(A[i * size + j]) > amax)
+				amax = fabs(A[i * size + j]);
+
+	const double min_pivot = SMALL_SOLVER_PIVOT_TOL * amax;
+
+	switch(size) {
+		case 16:
+			return small_solve_16(A, b, min_pivot);
+		case 32:
+			return small_solve_32(A, b, min_pivot);
+		case 48:
+			return small_solve_48(A, b, min_pivot);
+		case 64:
+			return small_solve_64(A, b, min_pivot);
+		case 80:
+			return small_solve_80(A, b, min_pivot);
+		case 96:
+			return small_solve_96(A, b, min_pivot);
+		case 112:
+			return small_solve_112(A, b, min_pivot);
+		case 128:
+			return small_solve_128(A, b, min_pivot);
+		default:
+			/* Something bad happened */
+			assert(0);
+			return 1;
+	}
+}
+
+/* Solve BATCH_WIDTH symmetric systems of size n at once. Element (i, j) of the
+ * l-th system is stored at A[(i * n + j) * BATCH_WIDTH + l], its right-hand side at
+ * b[i * BATCH_WIDTH + l] and only the upper triangle is referenced. Systems are
+ * factorized without pivoting; failed[l] is set for systems with a too small pivot,
+ * their solutions are meaningless. */
+void batch_solve(double * const A, double * const b, int n, int * const failed) {
+
+	assert(A != NULL);
+	assert(b != NULL);
+	assert(failed != NULL);
+
+	#define W BATCH_WIDTH
+	#define A_IDX(i, j) (((long int) (i) * n + (j)) * W)
+
+	double min_pivot[W];
+	for(int l = 0; l < W; l++) {
+		min_pivot[l] = 0.0;
+		failed[l] = 0;
+	}
+
+	for(int i = 0; i < n; i++)
+		for(int j = i; j < n; j++)
+			for(int l = 0; l < W; l++)
+				if(fabs(A[A_IDX(i, j) + l]) > min_pivot[l])
+					min_pivot[l] = fabs(A[A_IDX(i, j) + l]);
+
+	for(int l = 0; l < W; l++)
+		min_pivot[l] *= SMALL_SOLVER_PIVOT_TOL;
+
+	for(int k = 0; k < n; k++) {
+		double dinv[W];
+		for(int l = 0; l < W; l++) {
+			/* Keep eliminating the failed system, its result is discarded anyway */
+			if(!(fabs(A[A_IDX(k, k) + l]) > min_pivot[l])) {
+				failed[l] = 1;
+				A[A_IDX(k, k) + l] = 1.0;
+			}
+			dinv[l] = 1.0 / A[A_IDX(k, k) + l];
+		}
+
+		for(int i = k + 1; i < n; i++) {
+			double f[W];
+			for(int l = 0; l < W; l++)
+				f[l] = A[A_IDX(k, i) + l] * dinv[l];
+
+			for(int j = i; j < n; j++)
+				for(int l = 0; l < W; l++)
+					A[A_IDX(i, j) + l] -= f[l] * A[A_IDX(k, j) + l];
+
+			for(int l = 0; l < W; l++)
+				b[i * W + l] -= f[l] * b[k * W + l];
+		}
+	}
+
+	for(int k = n - 1; k >= 0; k--) {
+		double sum[W];
+		for(int l = 0; l < W; l++)
+			sum[l] = b[k * W + l];
+
+		for(int j = k + 1; j < n; j++)
+			for(int l = 0; l < W; l++)
+				sum[l] -= A[A_IDX(k, j) + l] * b[j * W + l];
+
+		for(int l = 0; l < W; l++)
+			b[k * W + l] = sum[l] / A[A_IDX(k, k) + l];
+	}
+
+	#undef A_IDX
+	#undef W
+}
@@ -0,0 +1,41 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SMALLSOLVE_H__
+#define __SMALLSOLVE_H__
+
+/* Systems up to this size are solved by the fixed-size kernels; sizes are
+ * rounded up to the multiple of SMALL_SOLVER_STEP */
+#define SMALL_SOLVER_MAX_SIZE 128
+#define SMALL_SOLVER_STEP 16
+
+/* Pivots smaller than this fraction of the largest element are rejected */
+#define SMALL_SOLVER_PIVOT_TOL 1e-10
+
+/* Solutions with larger normwise backward error are rejected; as the kernels don't
+ * pivot, the error grows with the elements of the factor, see is_solution_accurate() */
+#define SMALL_SOLVER_RESIDUAL_TOL 1e-10
+
+/* Number of equally sized systems solved at once by batch_solve() */
+#define BATCH_WIDTH 8
+
+int small_solver_size(int n);
+int small_solve(double * const A, double * const b, int size);
+void batch_solve(double * const A, double * const b, int n, int * const failed);
+
+#endif /* __SMALLSOLVE_H__ */
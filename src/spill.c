@@ -0,0 +1,102 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "neemp.h"
+#include "settings.h"
+#include "spill.h"
+#include "structures.h"
+
+extern const struct settings s;
+extern struct training_set ts;
+
+/* Create an arena for count reciprocal distances backed by the spill file. The
+ * file is unlinked right away, so its blocks are released once it is unmapped
+ * or the program exits, and a new arena can be mapped under the same name. */
+rdist_t *spill_map(long int count) {
+
+	if(count == 0)
+		return NULL;
+
+	const size_t size = count * sizeof(rdist_t);
+
+	int fd = open(s.spill_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if(fd < 0)
+		EXIT_ERROR(IO_ERROR, "Cannot open spill file %s.\n", s.spill_file);
+
+	if(ftruncate(fd, (off_t) size))
+		EXIT_ERROR(IO_ERROR, "Cannot resize spill file %s.\n", s.spill_file);
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED)
+		EXIT_ERROR(IO_ERROR, "Cannot map spill file %s.\n", s.spill_file);
+
+	close(fd);
+	unlink(s.spill_file);
+
+	return (rdist_t *) p;
+}
+
+/* Release the arena created by spill_map */
+void spill_unmap(rdist_t * const rdists, long int count) {
+
+	if(rdists == NULL)
+		return;
+
+	munmap(rdists, count * sizeof(rdist_t));
+}
+
+/* Ask the kernel to start reading the reciprocal distances of molecules first ... last - 1;
+ * the call does not wait for the data, so the solver keeps running meanwhile */
+void spill_readahead(int first, int last) {
+
+	if(last > ts.molecules_count)
+		last = ts.molecules_count;
+
+	/* Find the span of the cached molecules in the range */
+	long int begin = -1;
+	long int end = -1;
+	for(int i = first; i < last; i++) {
+		#define MOLECULE ts.molecules[i]
+		if(MOLECULE.rdists_offset < 0)
+			continue;
+
+		const long int n = MOLECULE.atoms_count;
+		if(begin < 0)
+			begin = MOLECULE.rdists_offset;
+		end = MOLECULE.rdists_offset + (n * (n - 1)) / 2;
+		#undef MOLECULE
+	}
+
+	if(begin < 0 || end <= begin)
+		return;
+
+	/* The address has to be aligned to the page size */
+	const long int page = sysconf(_SC_PAGESIZE);
+	char *from = (char *) (ts.rdists + begin);
+	char *aligned = (char *) ((size_t) from & ~((size_t) page - 1));
+
+	posix_madvise(aligned, (char *) (ts.rdists + end) - aligned, POSIX_MADV_WILLNEED);
+}
@@ -0,0 +1,32 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include "structures.h"
+
+/* Reciprocal distances of this many molecules are requested from the spill
+ * file ahead of the molecule being solved */
+#define SPILL_READAHEAD_MOLECULES 64
+
+rdist_t *spill_map(long int count);
+void spill_unmap(rdist_t * const rdists, long int count);
+void spill_readahead(int first, int last);
+
+#endif /* __SPILL_H__ */
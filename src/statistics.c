@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include "config.h"
+#include "eem.h"
 #include "neemp.h"
 #include "settings.h"
 #include "statistics.h"
@@ -32,10 +33,32 @@
 extern const struct training_set ts;
 extern const struct settings s;
 
+/* Running sums of the charges of one atom type, see calculate_charges_and_statistics */
+struct at_sums {
+
+	double x, y;
+	double xx, yy, xy;
+	double diff2, diff, diff_max;
+};
+
+/* Running sums of the total statistics of one kappa_data */
+struct kappa_sums {
+
+	double R, R2, spearman;
+	double RMSD, D_avg, D_max;
+	int R_bad, R2_bad, spearman_bad;
+	int iterations;
+};
 
 static int compare(const void *p1, const void *p2);
 static void adjust_ranks_via_pointers(float **array, int n);
 
+static int molecule_R(int i, const float * const charges, double * const R);
+static int molecule_Spearman(int i, const float * const charges, double * const spearman);
+static double molecule_RMSD(int i, const float * const charges);
+static double molecule_D_avg(int i, const float * const charges);
+static double molecule_D_max(int i, const float * const charges);
+
 static void set_total_Spearman(struct kappa_data * const kd);
 static void set_total_R(struct kappa_data * const kd);
 static void set_total_R_w(struct kappa_data *const kd);
@@ -49,6 +72,11 @@ static void set_per_at_RMSD(struct kappa_data * const kd);
 static void set_per_at_D_avg(struct kappa_data * const kd);
 static void set_per_at_D_max(struct kappa_data * const kd);
 
+static void add_molecule_to_sums(int i, int weight, const float * const charges, const double * const shift,
+				 struct kappa_sums * const kt, struct at_sums * const sums);
+static void set_stats_from_sums(struct kappa_data * const kd, const struct kappa_sums * const kt,
+				const struct at_sums * const sums, int molecules_count, const int * const atoms_count);
+
 
 /* Compare two floats via pointers */
 static int compare(const void *p1, const void *p2) {
@@ -90,6 +118,166 @@ static void adjust_ranks_via_pointers(float **array, int n) {
 }
 
 
+/* Pearson correlation coeff. of the i-th molecule's charges with the reference ones;
+ * return 0 if it is not defined */
+static int molecule_R(int i, const float * const charges, double * const R) {
+
+	assert(charges != NULL);
+	assert(R != NULL);
+
+	#define MOLECULE ts.molecules[i]
+	const float * const reference = ts.reference_charge + ts.molecule_starts[i];
+
+	double average_calculated_charge = 0.0;
+	for(int j = 0; j < MOLECULE.atoms_count; j++) {
+		average_calculated_charge += charges[j];
+	}
+
+	average_calculated_charge /= MOLECULE.atoms_count;
+
+	double cov_xy = 0.0;
+	double cov_xx = 0.0;
+	double cov_yy = 0.0;
+
+	for(int j = 0; j < MOLECULE.atoms_count; j++) {
+		double diff_x = charges[j] - average_calculated_charge;
+		double diff_y = reference[j] - MOLECULE.average_charge;
+
+		cov_xy += diff_x * diff_y;
+		cov_xx += diff_x * diff_x;
+		cov_yy += diff_y * diff_y;
+	}
+	#undef MOLECULE
+
+	*R = cov_xy / sqrt(cov_xx * cov_yy);
+
+	/* Avoid division by zero */
+	return fabs(cov_xx * cov_yy) > 0.0f;
+}
+
+
+/* Spearman correlation coeff. of the i-th molecule's charges with the reference ones;
+ * return 0 if it is not defined */
+static int molecule_Spearman(int i, const float * const charges, double * const spearman) {
+
+	assert(charges != NULL);
+	assert(spearman != NULL);
+
+	#define MOLECULE ts.molecules[i]
+	float *reference_data = (float *) calloc(MOLECULE.atoms_count, sizeof(float));
+	float *calculated_data = (float *) calloc(MOLECULE.atoms_count, sizeof(float));
+	float **reference_data_pointers = (float **) calloc(MOLECULE.atoms_count, sizeof(float *));
+	float **calculated_data_pointers = (float **) calloc(MOLECULE.atoms_count, sizeof(float *));
+	if(!reference_data || !calculated_data || !calculated_data_pointers || !reference_data_pointers)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for Spearman correlation computation.");
+
+	memcpy(calculated_data, charges, sizeof(float) * MOLECULE.atoms_count);
+	memcpy(reference_data, ts.reference_charge + ts.molecule_starts[i], sizeof(float) * MOLECULE.atoms_count);
+
+	/* Set pointers to the data */
+	for(int j = 0; j < MOLECULE.atoms_count; j++) {
+		reference_data_pointers[j] = &reference_data[j];
+		calculated_data_pointers[j] = &calculated_data[j];
+	}
+
+	qsort(reference_data_pointers, MOLECULE.atoms_count, sizeof(float *), compare);
+	qsort(calculated_data_pointers, MOLECULE.atoms_count, sizeof(float *), compare);
+
+	adjust_ranks_via_pointers(reference_data_pointers, MOLECULE.atoms_count);
+	adjust_ranks_via_pointers(calculated_data_pointers, MOLECULE.atoms_count);
+
+	/* Use Pearson correlation between computed ranks */
+	double average_calculated_rank = 0.0;
+	double average_reference_rank = 0.0;
+	for(int j = 0; j < MOLECULE.atoms_count; j++) {
+		average_reference_rank += reference_data[j];
+		average_calculated_rank += calculated_data[j];
+	}
+
+	average_reference_rank /= MOLECULE.atoms_count;
+	average_calculated_rank /= MOLECULE.atoms_count;
+
+	double cov_xy = 0.0;
+	double cov_xx = 0.0;
+	double cov_yy = 0.0;
+
+	for(int j = 0; j < MOLECULE.atoms_count; j++) {
+		double diff_x = calculated_data[j] - average_calculated_rank;
+		double diff_y = reference_data[j] - average_reference_rank;
+
+		cov_xy += diff_x * diff_y;
+		cov_xx += diff_x * diff_x;
+		cov_yy += diff_y * diff_y;
+	}
+	#undef MOLECULE
+
+	free(reference_data);
+	free(calculated_data);
+	free(reference_data_pointers);
+	free(calculated_data_pointers);
+
+	*spearman = cov_xy / sqrt(cov_xx * cov_yy);
+
+	/* Avoid division by zero */
+	return fabs(cov_xx * cov_yy) > 0.0f;
+}
+
+
+/* RMSD of the i-th molecule's charges */
+static double molecule_RMSD(int i, const float * const charges) {
+
+	assert(charges != NULL);
+
+	const float * const reference = ts.reference_charge + ts.molecule_starts[i];
+
+	double diff2_sum_molecule = 0.0;
+	for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
+		double diff = charges[j] - reference[j];
+
+		diff2_sum_molecule += fabs(diff) * fabs(diff);
+	}
+
+	return sqrt(diff2_sum_molecule / ts.molecules[i].atoms_count);
+}
+
+
+/* Average absolute difference of the i-th molecule's charges */
+static double molecule_D_avg(int i, const float * const charges) {
+
+	assert(charges != NULL);
+
+	const float * const reference = ts.reference_charge + ts.molecule_starts[i];
+
+	double D_sum_molecule = 0.0;
+	for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
+		double diff = charges[j] - reference[j];
+
+		D_sum_molecule += fabs(diff);
+	}
+
+	return D_sum_molecule / ts.molecules[i].atoms_count;
+}
+
+
+/* Maximum absolute difference of the i-th molecule's charges */
+static double molecule_D_max(int i, const float * const charges) {
+
+	assert(charges != NULL);
+
+	const float * const reference = ts.reference_charge + ts.molecule_starts[i];
+
+	double max_diff_per_molecule = 0.0;
+	for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
+		double diff = charges[j] - reference[j];
+
+		if(fabs(diff) > max_diff_per_molecule)
+			max_diff_per_molecule = fabs(diff);
+	}
+
+	return max_diff_per_molecule;
+}
+
+
 /* Set total weighted correlation computed of individual Pearson's coeff per atom type */
 static void set_total_R_w(struct kappa_data * const kd) {
 
@@ -116,76 +304,20 @@ static void set_total_Spearman(struct kappa_data * const kd) {
 
 	assert(kd != NULL);
 
-	int atoms_processed = 0;
 	int bad_molecules = 0;
 
 	double spearman_sum_molecules = 0.0;
 
 	for(int i = 0; i < ts.molecules_count; i++) {
-		#define MOLECULE ts.molecules[i]
-
-		float *reference_data = (float *) calloc(MOLECULE.atoms_count, sizeof(float));
-		float *calculated_data = (float *) calloc(MOLECULE.atoms_count, sizeof(float));
-		float **reference_data_pointers = (float **) calloc(MOLECULE.atoms_count, sizeof(float *));
-		float **calculated_data_pointers = (float **) calloc(MOLECULE.atoms_count, sizeof(float *));
-		if(!reference_data || !calculated_data || !calculated_data_pointers || !reference_data_pointers)
-			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for Spearman correlation computation.");
-
-		memcpy(calculated_data, &kd->charges[atoms_processed], sizeof(float) * MOLECULE.atoms_count);
-		for(int j = 0; j < MOLECULE.atoms_count; j++)
-			reference_data[j] = MOLECULE.atoms[j].reference_charge;
-
-		/* Set pointers to the data */
-		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			reference_data_pointers[j] = &reference_data[j];
-			calculated_data_pointers[j] = &calculated_data[j];
-		}
-
-		qsort(reference_data_pointers, MOLECULE.atoms_count, sizeof(float *), compare);
-		qsort(calculated_data_pointers, MOLECULE.atoms_count, sizeof(float *), compare);
-
-		adjust_ranks_via_pointers(reference_data_pointers, MOLECULE.atoms_count);
-		adjust_ranks_via_pointers(calculated_data_pointers, MOLECULE.atoms_count);
-
-		/* Use Pearson correlation between computed ranks */
-		double average_calculated_rank = 0.0;
-		double average_reference_rank = 0.0;
-		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			average_reference_rank += reference_data[j];
-			average_calculated_rank += calculated_data[j];
-		}
-
-		average_reference_rank /= MOLECULE.atoms_count;
-		average_calculated_rank /= MOLECULE.atoms_count;
-
-		double cov_xy = 0.0;
-		double cov_xx = 0.0;
-		double cov_yy = 0.0;
+		double spearman;
+		const int valid = molecule_Spearman(i, kd->charges + ts.molecule_starts[i], &spearman);
 
-		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			double diff_x = calculated_data[j] - average_calculated_rank;
-			double diff_y = reference_data[j] - average_reference_rank;
+		kd->per_molecule_stats[i].spearman = (float) spearman;
 
-			cov_xy += diff_x * diff_y;
-			cov_xx += diff_x * diff_x;
-			cov_yy += diff_y * diff_y;
-		}
-
-		kd->per_molecule_stats[i].spearman = (float) (cov_xy / sqrt(cov_xx * cov_yy));
-
-		/* Avoid division by zero */
-		if(fabs(cov_xx * cov_yy) <= 0.0f)
-			bad_molecules++;
+		if(valid)
+			spearman_sum_molecules += spearman;
 		else
-			spearman_sum_molecules += cov_xy / sqrt(cov_xx * cov_yy);
-
-		free(reference_data);
-		free(calculated_data);
-		free(reference_data_pointers);
-		free(calculated_data_pointers);
-
-		atoms_processed += MOLECULE.atoms_count;
-		#undef MOLECULE
+			bad_molecules++;
 	}
 
 	kd->full_stats.spearman = (float) (spearman_sum_molecules / (ts.molecules_count - bad_molecules));
@@ -196,44 +328,19 @@ static void set_total_R(struct kappa_data * const kd) {
 
 	assert(kd != NULL);
 
-	int atoms_processed = 0;
-
 	int bad_molecules = 0;
 	double R_sum_molecules = 0.0;
 
 	for(int i = 0; i < ts.molecules_count; i++) {
-		#define MOLECULE ts.molecules[i]
-
-		double average_calculated_charge = 0.0;
-		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			average_calculated_charge += kd->charges[atoms_processed + j];
-		}
-
-		average_calculated_charge /= MOLECULE.atoms_count;
-
-		double cov_xy = 0.0;
-		double cov_xx = 0.0;
-		double cov_yy = 0.0;
-
-		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			double diff_x = kd->charges[atoms_processed + j] - average_calculated_charge;
-			double diff_y = MOLECULE.atoms[j].reference_charge - MOLECULE.average_charge;
-
-			cov_xy += diff_x * diff_y;
-			cov_xx += diff_x * diff_x;
-			cov_yy += diff_y * diff_y;
-		}
+		double R;
+		const int valid = molecule_R(i, kd->charges + ts.molecule_starts[i], &R);
 
-		kd->per_molecule_stats[i].R = (float) (cov_xy / sqrt(cov_xx * cov_yy));
+		kd->per_molecule_stats[i].R = (float) R;
 
-		/* Avoid division by zero */
-		if(fabs(cov_xx * cov_yy) <= 0.0f)
-			bad_molecules++;
+		if(valid)
+			R_sum_molecules += R;
 		else
-			R_sum_molecules += cov_xy / sqrt(cov_xx * cov_yy);
-
-		atoms_processed += MOLECULE.atoms_count;
-		#undef MOLECULE
+			bad_molecules++;
 	}
 
 	kd->full_stats.R = (float) (R_sum_molecules / (ts.molecules_count - bad_molecules));
@@ -267,24 +374,12 @@ static void set_total_RMSD(struct kappa_data * const kd) {
 
 	assert(kd != NULL);
 
-	int atoms_processed = 0;
-
 	double RMSD_sum_molecules = 0.0;
 	for(int i = 0; i < ts.molecules_count; i++) {
-		#define MOLECULE ts.molecules[i]
-
-		double diff2_sum_molecule = 0.0;
-		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			double diff = kd->charges[atoms_processed + j] - MOLECULE.atoms[j].reference_charge;
-
-			diff2_sum_molecule += fabs(diff) * fabs(diff);
-		}
-
-		kd->per_molecule_stats[i].RMSD = (float) sqrt(diff2_sum_molecule / MOLECULE.atoms_count);
-		RMSD_sum_molecules += sqrt(diff2_sum_molecule / MOLECULE.atoms_count);
+		const double RMSD = molecule_RMSD(i, kd->charges + ts.molecule_starts[i]);
 
-		atoms_processed += MOLECULE.atoms_count;
-		#undef MOLECULE
+		kd->per_molecule_stats[i].RMSD = (float) RMSD;
+		RMSD_sum_molecules += RMSD;
 	}
 
 	kd->full_stats.RMSD = (float) (RMSD_sum_molecules / ts.molecules_count);
@@ -307,23 +402,12 @@ static void set_total_D_avg(struct kappa_data * const kd) {
 
 	assert(kd != NULL);
 
-	int atoms_processed = 0;
-
 	double D_avg_sum_molecules = 0.0;
 	for(int i = 0; i < ts.molecules_count; i++) {
-		#define MOLECULE ts.molecules[i]
-
-		double D_sum_molecule = 0.0;
-		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			double diff = kd->charges[atoms_processed + j] - MOLECULE.atoms[j].reference_charge;
-
-			D_sum_molecule += fabs(diff);
-		}
+		const double D_avg = molecule_D_avg(i, kd->charges + ts.molecule_starts[i]);
 
-		kd->per_molecule_stats[i].D_avg = (float) (D_sum_molecule / MOLECULE.atoms_count);
-		D_avg_sum_molecules += D_sum_molecule / MOLECULE.atoms_count;
-		atoms_processed += MOLECULE.atoms_count;
-		#undef MOLECULE
+		kd->per_molecule_stats[i].D_avg = (float) D_avg;
+		D_avg_sum_molecules += D_avg;
 	}
 
 	kd->full_stats.D_avg = (float) (D_avg_sum_molecules / ts.molecules_count);
@@ -335,25 +419,12 @@ static void set_total_D_max(struct kappa_data * const kd) {
 
 	assert(kd != NULL);
 
-	int atoms_processed = 0;
-
 	double D_max_sum_molecules = 0.0;
 	for(int i = 0; i < ts.molecules_count; i++) {
-		#define MOLECULE ts.molecules[i]
-
-		double max_diff_per_molecule = 0.0;
-		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			double diff = kd->charges[atoms_processed + j] - MOLECULE.atoms[j].reference_charge;
+		const double D_max = molecule_D_max(i, kd->charges + ts.molecule_starts[i]);
 
-			if(fabs(diff) > max_diff_per_molecule)
-				max_diff_per_molecule = fabs(diff);
-		}
-
-		D_max_sum_molecules += max_diff_per_molecule;
-		kd->per_molecule_stats[i].D_max = (float) max_diff_per_molecule;
-
-		atoms_processed += MOLECULE.atoms_count;
-		#undef MOLECULE
+		D_max_sum_molecules += D_max;
+		kd->per_molecule_stats[i].D_max = (float) D_max;
 	}
 
 	kd->full_stats.D_max = (float) (D_max_sum_molecules / ts.molecules_count);
@@ -364,25 +435,19 @@ static void set_per_at_R_R2(struct kappa_data * const kd) {
 
 	assert(kd != NULL);
 
-	/* Compute starting indices for storing the charges of each molecule. These are
-	 * needed to access individual charges. */
-	int starts[ts.molecules_count];
-	starts[0] = 0;
-	for(int i = 1; i < ts.molecules_count; i++)
-		starts[i] = starts[i - 1] + ts.molecules[i - 1].atoms_count;
-
 	for(int i = 0; i < ts.atom_types_count; i++) {
 		#define AT ts.atom_types[i]
 
+		/* Atoms of this type are contiguous in the atom type order */
+		const int * const order = ts.type_order + ts.atom_type_starts[i];
+		const float * const reference = ts.type_reference_charge + ts.atom_type_starts[i];
+
 		double avg_eem_chg_per_at = 0.0;
 		double avg_qm_chg_per_at = 0.0;
 
 		for(int j = 0; j < AT.atoms_count; j++) {
-			const int molecule_idx = AT.atoms_molecule_idx[j];
-			const int atom_idx = AT.atoms_atom_idx[j];
-
-			avg_qm_chg_per_at += ts.molecules[molecule_idx].atoms[atom_idx].reference_charge;
-			avg_eem_chg_per_at += kd->charges[starts[molecule_idx] + atom_idx];
+			avg_qm_chg_per_at += reference[j];
+			avg_eem_chg_per_at += kd->charges[order[j]];
 		}
 
 		avg_qm_chg_per_at /= AT.atoms_count;
@@ -392,12 +457,9 @@ static void set_per_at_R_R2(struct kappa_data * const kd) {
 		double cov_xy = 0.0;
 		double cov_yy = 0.0;
 
-		for(int j = 0; j < ts.atom_types[i].atoms_count; j++) {
-			const int molecule_idx = AT.atoms_molecule_idx[j];
-			const int atom_idx = AT.atoms_atom_idx[j];
-
-			double diff_x = kd->charges[starts[molecule_idx] + atom_idx] - avg_eem_chg_per_at;
-			double diff_y = ts.molecules[molecule_idx].atoms[atom_idx].reference_charge - avg_qm_chg_per_at;
+		for(int j = 0; j < AT.atoms_count; j++) {
+			double diff_x = kd->charges[order[j]] - avg_eem_chg_per_at;
+			double diff_y = reference[j] - avg_qm_chg_per_at;
 
 			cov_xy += diff_x * diff_y;
 			cov_xx += diff_x * diff_x;
@@ -417,13 +479,6 @@ static void set_per_at_Spearman(struct kappa_data * const kd) {
 
 	assert(kd != NULL);
 
-	/* Compute starting indices for storing the charges of each molecule. These are
-	 * needed to access individual charges. */
-	int starts[ts.molecules_count];
-	starts[0] = 0;
-	for(int i = 1; i < ts.molecules_count; i++)
-		starts[i] = starts[i - 1] + ts.molecules[i - 1].atoms_count;
-
 	for(int i = 0; i < ts.atom_types_count; i++) {
 		#define AT ts.atom_types[i]
 		float *reference_data = (float *) calloc(AT.atoms_count, sizeof(float));
@@ -434,13 +489,11 @@ static void set_per_at_Spearman(struct kappa_data * const kd) {
 		if(!reference_data || !calculated_data || !calculated_data_pointers || !reference_data_pointers)
 			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for Spearman correlation computation.");
 
-		for(int j = 0; j < AT.atoms_count; j++) {
-			const int molecule_idx = AT.atoms_molecule_idx[j];
-			const int atom_idx = AT.atoms_atom_idx[j];
+		const int * const order = ts.type_order + ts.atom_type_starts[i];
+		for(int j = 0; j < AT.atoms_count; j++)
+			calculated_data[j] = kd->charges[order[j]];
 
-			calculated_data[j] = kd->charges[starts[molecule_idx] + atom_idx];
-			reference_data[j] = ts.molecules[molecule_idx].atoms[atom_idx].reference_charge;
-		}
+		memcpy(reference_data, ts.type_reference_charge + ts.atom_type_starts[i], AT.atoms_count * sizeof(float));
 
 		/* Set pointers to the data */
 		for(int j = 0; j < AT.atoms_count; j++) {
@@ -494,22 +547,15 @@ static void set_per_at_RMSD(struct kappa_data * const kd) {
 
 	assert(kd != NULL);
 
-	/* Compute starting indices for storing the charges of each molecule. These are
-	 * needed to access individual charges. */
-	int starts[ts.molecules_count];
-	starts[0] = 0;
-	for(int i = 1; i < ts.molecules_count; i++)
-		starts[i] = starts[i - 1] + ts.molecules[i - 1].atoms_count;
-
 	for(int i = 0; i < ts.atom_types_count; i++) {
 		#define AT ts.atom_types[i]
 
+		const int * const order = ts.type_order + ts.atom_type_starts[i];
+		const float * const reference = ts.type_reference_charge + ts.atom_type_starts[i];
+
 		double diff2_sum = 0.0;
 		for(int j  = 0; j < AT.atoms_count; j++) {
-			const int molecule_idx = AT.atoms_molecule_idx[j];
-			const int atom_idx = AT.atoms_atom_idx[j];
-
-			double diff = ts.molecules[molecule_idx].atoms[atom_idx].reference_charge - kd->charges[starts[molecule_idx] + atom_idx];
+			double diff = reference[j] - kd->charges[order[j]];
 			diff2_sum += diff * diff;
 		}
 
@@ -535,9 +581,9 @@ static void set_per_at_D_avg(struct kappa_data * const kd) {
 		#define MOLECULE ts.molecules[i]
 
 		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			double diff = kd->charges[atoms_processed + j] - MOLECULE.atoms[j].reference_charge;
+			double diff = kd->charges[atoms_processed + j] - ts.reference_charge[atoms_processed + j];
 
-			const int at_idx = get_atom_type_idx(&MOLECULE.atoms[j]);
+			const int at_idx = ts.atom_type_idx[atoms_processed + j];
 
 			D_sum_atom_type[at_idx] += fabs(diff);
 		}
@@ -568,9 +614,9 @@ static void set_per_at_D_max(struct kappa_data * const kd) {
 		#define MOLECULE ts.molecules[i]
 
 		for(int j = 0; j < MOLECULE.atoms_count; j++) {
-			double diff = kd->charges[atoms_processed + j] - MOLECULE.atoms[j].reference_charge;
+			double diff = kd->charges[atoms_processed + j] - ts.reference_charge[atoms_processed + j];
 
-			const int at_idx = get_atom_type_idx(&MOLECULE.atoms[j]);
+			const int at_idx = ts.atom_type_idx[atoms_processed + j];
 
 			if(fabs(diff) > kd->per_at_stats[at_idx].D_max)
 				kd->per_at_stats[at_idx].D_max = (float) fabs(diff);
@@ -608,6 +654,258 @@ void calculate_statistics(struct subset * const ss, struct kappa_data * const kd
 	set_total_RMSD_avg(kd);
 }
 
+/* Add the statistics of the i-th molecule's charges to the running sums weight times;
+ * charges of atom type k are shifted by shift[k] */
+static void add_molecule_to_sums(int i, int weight, const float * const charges, const double * const shift,
+				 struct kappa_sums * const kt, struct at_sums * const sums) {
+
+	assert(charges != NULL);
+	assert(shift != NULL);
+	assert(kt != NULL);
+	assert(sums != NULL);
+
+	double R, spearman;
+	if(molecule_R(i, charges, &R))
+		kt->R += weight * R;
+	else
+		kt->R_bad += weight;
+
+	/* Same as set_total_R2, which squares the stored single precision value */
+	const double R_single = (float) R;
+	if(isnan(R_single))
+		kt->R2_bad += weight;
+	else
+		kt->R2 += weight * R_single * R_single;
+
+	if(molecule_Spearman(i, charges, &spearman))
+		kt->spearman += weight * spearman;
+	else
+		kt->spearman_bad += weight;
+
+	kt->RMSD += weight * molecule_RMSD(i, charges);
+	kt->D_avg += weight * molecule_D_avg(i, charges);
+	kt->D_max += weight * molecule_D_max(i, charges);
+
+	const int start = ts.molecule_starts[i];
+	for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
+		const int at_idx = ts.atom_type_idx[start + j];
+		const double x = charges[j] - shift[at_idx];
+		const double y = ts.reference_charge[start + j] - shift[at_idx];
+		const double diff = fabs(x - y);
+
+		sums[at_idx].x += weight * x;
+		sums[at_idx].y += weight * y;
+		sums[at_idx].xx += weight * x * x;
+		sums[at_idx].yy += weight * y * y;
+		sums[at_idx].xy += weight * x * y;
+		sums[at_idx].diff2 += weight * diff * diff;
+		sums[at_idx].diff += weight * diff;
+		if(diff > sums[at_idx].diff_max)
+			sums[at_idx].diff_max = diff;
+	}
+}
+
+/* Set the statistics of kd from the running sums over molecules_count molecules
+ * with atoms_count[k] atoms of atom type k; per atom type Spearman correlation needs
+ * the ranks of all atoms of the type, so it's set to NaN */
+static void set_stats_from_sums(struct kappa_data * const kd, const struct kappa_sums * const kt,
+				const struct at_sums * const sums, int molecules_count, const int * const atoms_count) {
+
+	assert(kd != NULL);
+	assert(kt != NULL);
+	assert(sums != NULL);
+	assert(atoms_count != NULL);
+
+	kd->full_stats.R = (float) (kt->R / (molecules_count - kt->R_bad));
+	kd->full_stats.R2 = (float) kt->R2 / (molecules_count - kt->R2_bad);
+	kd->full_stats.spearman = (float) (kt->spearman / (molecules_count - kt->spearman_bad));
+	kd->full_stats.RMSD = (float) (kt->RMSD / molecules_count);
+	kd->full_stats.D_avg = (float) (kt->D_avg / molecules_count);
+	kd->full_stats.D_max = (float) (kt->D_max / molecules_count);
+
+	for(int i = 0; i < ts.atom_types_count; i++) {
+		const double n = atoms_count[i];
+		const double cov_xy = sums[i].xy - sums[i].x * sums[i].y / n;
+		const double cov_xx = sums[i].xx - sums[i].x * sums[i].x / n;
+		const double cov_yy = sums[i].yy - sums[i].y * sums[i].y / n;
+
+		kd->per_at_stats[i].R = (float) (cov_xy / sqrt(cov_xx * cov_yy));
+		kd->per_at_stats[i].R2 = (float) ((cov_xy * cov_xy) / (cov_xx * cov_yy));
+		kd->per_at_stats[i].spearman = NAN;
+		kd->per_at_stats[i].RMSD = (float) sqrt(sums[i].diff2 / n);
+		kd->per_at_stats[i].D_avg = (float) (sums[i].diff / n);
+		kd->per_at_stats[i].D_max = (float) sums[i].diff_max;
+	}
+
+	/* Computed from per atom type stats, needs to go last */
+	set_total_R_w(kd);
+	set_total_RMSD_avg(kd);
+}
+
+/* Solve EEM molecule by molecule and fold the charges into the statistics right
+ * away, so kd->charges and kd->per_molecule_stats are not needed. Per atom type
+ * correlations come from running sums instead of two passes over the charges; per
+ * atom type Spearman correlation is not available and is set to NaN. */
+void calculate_charges_and_statistics(struct subset * const ss, struct kappa_data * const kd) {
+
+	assert(ss != NULL);
+	assert(kd != NULL);
+
+	calculate_charges_and_statistics_sweep(ss, kd, 1);
+}
+
+/* Same as calculate_charges_and_statistics for count kappa_data at once, which have
+ * their parameters set already. Each molecule is solved for all of them in turn, so
+ * its reciprocal distances are read from memory only once for the whole sweep. */
+void calculate_charges_and_statistics_sweep(struct subset * const ss, struct kappa_data * const kds, int count) {
+
+	assert(ss != NULL);
+	assert(kds != NULL);
+
+	const int types = ts.atom_types_count;
+
+	/* Charges of each atom type are shifted by its average reference charge so that
+	 * the running sums don't lose precision to cancellation */
+	double *shift = (double *) calloc(types, sizeof(double));
+	struct at_sums *sums = (struct at_sums *) calloc(count * types, sizeof(struct at_sums));
+	struct kappa_sums *totals = (struct kappa_sums *) calloc(count, sizeof(struct kappa_sums));
+	if(!shift || !sums || !totals)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for statistical data.\n");
+
+	for(int k = 0; k < ts.atoms_count; k++)
+		shift[ts.atom_type_idx[k]] += ts.reference_charge[k];
+	for(int i = 0; i < types; i++)
+		shift[i] /= ts.atom_types[i].atoms_count;
+
+	int max_atoms = 0;
+	for(int i = 0; i < ts.molecules_count; i++)
+		if(ts.molecules[i].atoms_count > max_atoms)
+			max_atoms = ts.molecules[i].atoms_count;
+
+	const int nthreads = ts.molecules_count < s.max_threads ? ts.molecules_count : s.max_threads;
+
+	#pragma omp parallel num_threads(nthreads)
+	{
+		float *charges = (float *) malloc(max_atoms * sizeof(float));
+		struct at_sums *local = (struct at_sums *) calloc(count * types, sizeof(struct at_sums));
+		struct kappa_sums *local_totals = (struct kappa_sums *) calloc(count, sizeof(struct kappa_sums));
+		if(!charges || !local || !local_totals)
+			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for statistical data.\n");
+
+		#pragma omp for schedule(dynamic)
+		for(int i = 0; i < ts.molecules_count; i++) {
+			const int n = ts.molecules[i].atoms_count;
+
+			/* Iterative solvers start from zero for the first kappa_data and from
+			 * the charges for the previous one afterwards */
+			memset(charges, 0x0, n * sizeof(float));
+
+			for(int k = 0; k < count; k++) {
+				struct kappa_sums * const kt = &local_totals[k];
+				struct at_sums * const ks = local + k * types;
+
+				float cond;
+				calculate_molecule_charges(&kds[k], i, charges, &cond, &kt->iterations);
+
+				add_molecule_to_sums(i, 1, charges, shift, kt, ks);
+			}
+		}
+
+		#pragma omp critical
+		{
+			for(int k = 0; k < count; k++) {
+				totals[k].R += local_totals[k].R;
+				totals[k].R2 += local_totals[k].R2;
+				totals[k].spearman += local_totals[k].spearman;
+				totals[k].RMSD += local_totals[k].RMSD;
+				totals[k].D_avg += local_totals[k].D_avg;
+				totals[k].D_max += local_totals[k].D_max;
+				totals[k].R_bad += local_totals[k].R_bad;
+				totals[k].R2_bad += local_totals[k].R2_bad;
+				totals[k].spearman_bad += local_totals[k].spearman_bad;
+				totals[k].iterations += local_totals[k].iterations;
+			}
+
+			for(int i = 0; i < count * types; i++) {
+				sums[i].x += local[i].x;
+				sums[i].y += local[i].y;
+				sums[i].xx += local[i].xx;
+				sums[i].yy += local[i].yy;
+				sums[i].xy += local[i].xy;
+				sums[i].diff2 += local[i].diff2;
+				sums[i].diff += local[i].diff;
+				if(local[i].diff_max > sums[i].diff_max)
+					sums[i].diff_max = local[i].diff_max;
+			}
+		}
+
+		free(charges);
+		free(local);
+		free(local_totals);
+	}
+
+	int *atoms_count = (int *) malloc(types * sizeof(int));
+	if(!atoms_count)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for statistical data.\n");
+
+	for(int i = 0; i < types; i++)
+		atoms_count[i] = ts.atom_types[i].atoms_count;
+
+	for(int k = 0; k < count; k++) {
+		kds[k].solver_iterations = totals[k].iterations;
+		set_stats_from_sums(&kds[k], &totals[k], sums + k * types, ts.molecules_count, atoms_count);
+	}
+
+	free(atoms_count);
+	free(shift);
+	free(sums);
+	free(totals);
+}
+
+/* Calculate statistics of kd->charges over the molecules of ss only, the others are
+ * left out and a resampled molecule counts as many times as it was drawn; per atom
+ * type Spearman correlation is set to NaN */
+void calculate_statistics_for_subset(const struct subset * const ss, struct kappa_data * const kd) {
+
+	assert(ss != NULL);
+	assert(kd != NULL);
+
+	const int types = ts.atom_types_count;
+
+	double *shift = (double *) calloc(types, sizeof(double));
+	struct at_sums *sums = (struct at_sums *) calloc(types, sizeof(struct at_sums));
+	int *atoms_count = (int *) calloc(types, sizeof(int));
+	if(!shift || !sums || !atoms_count)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for statistical data.\n");
+
+	for(int k = 0; k < ts.atoms_count; k++)
+		shift[ts.atom_type_idx[k]] += ts.reference_charge[k];
+	for(int i = 0; i < types; i++)
+		shift[i] /= ts.atom_types[i].atoms_count;
+
+	struct kappa_sums kt;
+	memset(&kt, 0x0, sizeof(struct kappa_sums));
+
+	int molecules_count = 0;
+	for(int i = 0; i < ts.molecules_count; i++) {
+		if(!b_get(&ss->molecules, i))
+			continue;
+
+		const int weight = ss->weights != NULL ? ss->weights[i] : 1;
+		add_molecule_to_sums(i, weight, kd->charges + ts.molecule_starts[i], shift, &kt, sums);
+
+		for(int j = 0; j < ts.molecules[i].atoms_count; j++)
+			atoms_count[ts.atom_type_idx[ts.molecule_starts[i] + j]] += weight;
+		molecules_count += weight;
+	}
+
+	set_stats_from_sums(kd, &kt, sums, molecules_count, atoms_count);
+
+	free(atoms_count);
+	free(shift);
+	free(sums);
+}
+
 /* Calculate statistics according to set sort type */
 void calculate_statistics_by_sort_mode(struct kappa_data* kd) {
 
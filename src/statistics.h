@@ -22,6 +22,9 @@
 #include "subset.h"
 
 void calculate_statistics(struct subset * const ss, struct kappa_data * const kd);
+void calculate_charges_and_statistics(struct subset * const ss, struct kappa_data * const kd);
+void calculate_charges_and_statistics_sweep(struct subset * const ss, struct kappa_data * const kds, int count);
+void calculate_statistics_for_subset(const struct subset * const ss, struct kappa_data * const kd);
 void calculate_statistics_by_sort_mode(struct kappa_data* kd);
 void check_charges(const struct kappa_data * const kd);
 
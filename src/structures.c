@@ -24,23 +24,36 @@
 
 #include "config.h"
 #include "neemp.h"
+#include "rdists.h"
 #include "settings.h"
+#include "shm.h"
+#include "spill.h"
 #include "structures.h"
 
 extern const struct settings s;
 extern struct training_set ts;
 
-static void a_destroy(struct atom * const a);
-static void m_calculate_rdists(struct molecule * const m);
+static int calculate_rdists(void);
+static void compact_rdists(void);
+static rdist_t *rdists_alloc(long int count);
+static void rdists_free(rdist_t * const rdists, long int count);
 static void m_calculate_avg_electronegativity(struct molecule * const m);
 static void m_calculate_charge_stats(struct molecule * const m);
 static void fill_atom_types(void);
+static void fill_flat_view(void);
+static void free_flat_view(void);
 static void list_molecules_without_charges(void);
 static void list_molecules_without_parameters(void);
 static void list_invalid_molecules(void);
 static void calculate_y(void);
 static void at_fill_from_atom(struct atom_type * const at, const struct atom * const a);
 static int at_compare_against_atom(const struct atom_type * const at, const struct atom * const a);
+static unsigned int at_hash(const struct atom * const a);
+static int at_table_slot(const struct atom * const a);
+
+/* Open addressing hash table of indices into ts.atom_types; empty slots are NOT_FOUND */
+#define AT_TABLE_SIZE (4 * MAX_ATOM_TYPES)
+static int at_table[AT_TABLE_SIZE];
 
 /* Symbols for chemical elements */
 static const char * const elems[] = {"??", "H","He","Li","Be","B","C","N","O","F","Ne","Na","Mg","Al","Si","P","S","Cl","Ar","K","Ca","Sc","Ti","V","Cr","Mn","Fe","Co","Ni","Cu","Zn","Ga","Ge","As","Se","Br","Kr","Rb","Sr","Y","Zr","Nb","Mo","Tc","Ru","Rh","Pd","Ag","Cd","In","Sn","Sb","Te","I","Xe","Cs","Ba","La","Ce","Pr","Nd","Pm","Sm","Eu","Gd","Tb","Dy","Ho","Er","Tm","Yb","Lu","Hf","Ta","W","Re","Os","Ir","Pt","Au","Hg","Tl","Pb","Bi","Po","At","Rn","Fr","Ra","Ac","Th","Pa","U","Np","Pu","Am","Cm","Bk","Cf","Es","Fm","Md","No","Lr"};
@@ -85,15 +98,6 @@ const char *convert_Z_to_symbol(int Z) {
 		return "??";
 }
 
-/* Destroy contents of an atom */
-static void a_destroy(struct atom * const a) {
-
-	assert(a != NULL);
-
-	if(s.mode == MODE_PARAMS)
-		free(a->rdists);
-}
-
 /* Calculates reciprocal distance between two atoms */
 double rdist(const struct atom * const a1, const struct atom * const a2) {
 
@@ -107,20 +111,114 @@ double rdist(const struct atom * const a1, const struct atom * const a2) {
 	return 1.0 / sqrt(dx * dx + dy * dy + dz * dz);
 }
 
-/* Calculate reciprocal distances for all atoms in the molecule */
-static void m_calculate_rdists(struct molecule * const m) {
+/* Calculate reciprocal distances of atoms for all molecules; they are stored in
+ * one arena holding only the upper triangle of each molecule. With a memory
+ * budget, molecules that do not fit are left to be computed on the fly. Returns
+ * 1 if they were already published in the shared memory segment by another process. */
+static int calculate_rdists(void) {
 
-	assert(m != NULL);
+	const long int budget = (long int) (s.rdist_memory_budget * 1024 * 1024 / sizeof(rdist_t));
+	int cached = 0;
 
-	for(int i = 0; i < m->atoms_count; i++) {
-		m->atoms[i].rdists[i] = 0.0;
-		for(int j = i + 1; j < m->atoms_count; j++) {
-			double rd = rdist(&m->atoms[i], &m->atoms[j]);
-			/* Distance is symmetrical */
-			m->atoms[i].rdists[j] = rd;
-			m->atoms[j].rdists[i] = rd;
+	ts.rdists_count = 0;
+	for(int i = 0; i < ts.molecules_count; i++) {
+		const long int n = ts.molecules[i].atoms_count;
+		if(s.rdist_memory_budget >= 0.0f && ts.rdists_count + (n * (n - 1)) / 2 > budget) {
+			ts.molecules[i].rdists_offset = -1;
+			continue;
 		}
+
+		ts.molecules[i].rdists_offset = ts.rdists_count;
+		ts.rdists_count += (n * (n - 1)) / 2;
+		cached++;
 	}
+
+	if(s.rdist_memory_budget >= 0.0f)
+		printf("\nReciprocal distances cached for %d of %d molecules (%.1f MB)\n", cached, ts.molecules_count,
+		       (double) ts.rdists_count * sizeof(rdist_t) / (1024 * 1024));
+
+	int published = 0;
+	if(s.shm_name[0] != '\0') {
+		ts.rdists = shm_map(ts.rdists_count, &published);
+		if(published)
+			return 1;
+	} else
+		ts.rdists = rdists_alloc(ts.rdists_count);
+
+	for(int i = 0; i < ts.molecules_count; i++) {
+		#define MOLECULE ts.molecules[i]
+		if(MOLECULE.rdists_offset < 0)
+			continue;
+
+		rdist_t * const rdists = ts.rdists + MOLECULE.rdists_offset;
+		for(int k = 1; k < MOLECULE.atoms_count; k++)
+			for(int j = 0; j < k; j++)
+				rdists[RDIST_IDX(j, k)] = (rdist_t) rdist(&MOLECULE.atoms[j], &MOLECULE.atoms[k]);
+		#undef MOLECULE
+	}
+
+	return 0;
+}
+
+/* Move reciprocal distances of the remaining molecules together after some were discarded */
+static void compact_rdists(void) {
+
+	/* The shared segment is read-only for all but one process; the offsets of the
+	 * remaining molecules stay valid, so just leave the gaps there */
+	if(s.shm_name[0] != '\0')
+		return;
+
+	long int count = 0;
+	for(int i = 0; i < ts.molecules_count; i++) {
+		const long int n = ts.molecules[i].atoms_count;
+		if(ts.molecules[i].rdists_offset >= 0)
+			count += (n * (n - 1)) / 2;
+	}
+
+	if(count == ts.rdists_count)
+		return;
+
+	/* Molecules were reordered by discarding, so copy them into a new arena */
+	rdist_t *rdists = rdists_alloc(count);
+
+	long int offset = 0;
+	for(int i = 0; i < ts.molecules_count; i++) {
+		const long int n = ts.molecules[i].atoms_count;
+		if(ts.molecules[i].rdists_offset < 0)
+			continue;
+
+		memcpy(rdists + offset, ts.rdists + ts.molecules[i].rdists_offset, ((n * (n - 1)) / 2) * sizeof(rdist_t));
+		ts.molecules[i].rdists_offset = offset;
+		offset += (n * (n - 1)) / 2;
+	}
+
+	rdists_free(ts.rdists, ts.rdists_count);
+	ts.rdists = rdists;
+	ts.rdists_count = count;
+}
+
+/* Allocate the arena for count reciprocal distances, in the spill file if set */
+static rdist_t *rdists_alloc(long int count) {
+
+	if(s.spill_file[0] != '\0')
+		return spill_map(count);
+
+	rdist_t *rdists = (rdist_t *) malloc(count * sizeof(rdist_t));
+	if(!rdists && count > 0)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom distances.\n");
+
+	return rdists;
+}
+
+/* Free the arena allocated by rdists_alloc */
+static void rdists_free(rdist_t * const rdists, long int count) {
+
+	if(s.shm_name[0] != '\0')
+		shm_unmap();
+	else if(s.spill_file[0] != '\0')
+		spill_unmap(rdists, count);
+	else
+		free(rdists);
 }
 
 /* Destroy content of the molecule */
@@ -128,9 +226,6 @@ void m_destroy(struct molecule * const m) {
 
 	assert(m != NULL);
 
-	for(int i = 0; i < m->atoms_count; i++)
-		a_destroy(&m->atoms[i]);
-
 	free(m->atoms);
 	free(m->name);
 }
@@ -155,6 +250,8 @@ void ts_destroy(void) {
 
 	free(ts.molecules);
 	free(ts.atom_types);
+	rdists_free(ts.rdists, ts.rdists_count);
+	free_flat_view();
 }
 
 
@@ -163,35 +260,40 @@ void ts_destroy(void) {
 static void fill_atom_types(void) {
 
 	ts.atom_types = (struct atom_type *) malloc(sizeof(struct atom_type) * MAX_ATOM_TYPES);
+	if(!ts.atom_types)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom types.\n");
 	ts.atom_types_count = 0;
 
-	/* Find number of atom types present in the training set with appropriate atom counts */
+	for(int i = 0; i < AT_TABLE_SIZE; i++)
+		at_table[i] = NOT_FOUND;
+
+	/* Atom type indices are stored in the flat view, so it has to exist first */
+	fill_flat_view();
+
+	/* Assign the atom type to each atom; new types are numbered in the order of
+	 * their first occurrence so that the output does not depend on hashing */
 	for(int i = 0; i < ts.molecules_count; i++)
 		for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
 			#define ATOM ts.molecules[i].atoms[j]
-			int found = 0;
-			for(int k = 0; k < ts.atom_types_count; k++)
-				if(at_compare_against_atom(&ts.atom_types[k], &ATOM)) {
-					found = 1;
-					ts.atom_types[k].atoms_count++;
-					break;
-				}
+			const int slot = at_table_slot(&ATOM);
+			if(at_table[slot] == NOT_FOUND) {
+				if(ts.atom_types_count == MAX_ATOM_TYPES)
+					EXIT_ERROR(RUN_ERROR, "Maximum number of atom types (%d) reached. "
+							      "Increase value of MAX_ATOM_TYPES in config.h and recompile NEEMP.\n",
+							      MAX_ATOM_TYPES);
 
-			if(!found) {
 				/* Create new atom type */
 				at_fill_from_atom(&ts.atom_types[ts.atom_types_count], &ATOM);
-				ts.atom_types[ts.atom_types_count].atoms_count = 1;
+				ts.atom_types[ts.atom_types_count].atoms_count = 0;
 				ts.atom_types[ts.atom_types_count].has_parameters = 0;
-				ts.atom_types_count++;
+				at_table[slot] = ts.atom_types_count++;
 			}
+
+			ts.atom_type_idx[ts.molecule_starts[i] + j] = at_table[slot];
+			ts.atom_types[at_table[slot]].atoms_count++;
 			#undef ATOM
 		}
 
-	if(ts.atom_types_count > MAX_ATOM_TYPES)
-		EXIT_ERROR(RUN_ERROR, "Maximum number of atom types (%d) reached. "
-				      "Increase value of MAX_ATOM_TYPES in config.h and recompile NEEMP.\n",
-				      MAX_ATOM_TYPES);
-
 	/* Shrink atom types array */
 	ts.atom_types = (struct atom_type *) realloc(ts.atom_types, sizeof(struct atom_type) * ts.atom_types_count);
 
@@ -201,46 +303,107 @@ static void fill_atom_types(void) {
 		ts.atom_types[i].atoms_atom_idx = (int *) malloc(sizeof(int) * ts.atom_types[i].atoms_count);
 		if(!ts.atom_types[i].atoms_molecule_idx || !ts.atom_types[i].atoms_atom_idx)
 			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom types.\n");
-	}
 
-	/* Reset atom counts */
-	for(int i = 0; i < ts.atom_types_count; i++)
+		/* Reset counts */
 		ts.atom_types[i].atoms_count = 0;
+		ts.atom_types[i].molecules_count = 0;
+	}
 
-	/* Fill atom types with indices pointing to atoms of that kind */
+	/* Fill atom types with indices pointing to atoms of that kind; as molecules are
+	 * visited in order, a molecule is new for the type if it's not the last one stored */
 	for(int i = 0; i < ts.molecules_count; i++)
 		for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
-			#define ATOM ts.molecules[i].atoms[j]
-			for(int k = 0; k < ts.atom_types_count; k++) {
-				#define AT ts.atom_types[k]
-				/* Note that for every atom there exists k which satisfies following condition */
-				if(at_compare_against_atom(&AT, &ATOM)) {
-					AT.atoms_molecule_idx[AT.atoms_count] = i;
-					AT.atoms_atom_idx[AT.atoms_count] = j;
-					AT.atoms_count++;
-					break;
-				}
-				#undef AT
-			}
-			#undef ATOM
+			#define AT ts.atom_types[ts.atom_type_idx[ts.molecule_starts[i] + j]]
+			if(!AT.atoms_count || AT.atoms_molecule_idx[AT.atoms_count - 1] != i)
+				AT.molecules_count++;
+
+			AT.atoms_molecule_idx[AT.atoms_count] = i;
+			AT.atoms_atom_idx[AT.atoms_count] = j;
+			AT.atoms_count++;
+			#undef AT
 		}
 
-	/* Calculate number of molecules which contain particular atom type */
+	/* Group the flat atom indices by atom type, keeping the order used above */
+	ts.atom_type_starts = (int *) malloc((ts.atom_types_count + 1) * sizeof(int));
+	if(!ts.atom_type_starts)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom types.\n");
+
+	ts.atom_type_starts[0] = 0;
+	for(int i = 0; i < ts.atom_types_count; i++)
+		ts.atom_type_starts[i + 1] = ts.atom_type_starts[i] + ts.atom_types[i].atoms_count;
+
 	for(int i = 0; i < ts.atom_types_count; i++) {
 		#define AT ts.atom_types[i]
-		int *molecule_indices = (int *) calloc(ts.molecules_count, sizeof(int));
-		AT.molecules_count = 0;
-		for(int j = 0; j < AT.atoms_count; j++)
-			molecule_indices[AT.atoms_molecule_idx[j]] = 1;
-
-		for(int j = 0; j < ts.molecules_count; j++)
-			if(molecule_indices[j])
-				AT.molecules_count++;
+		const int start = ts.atom_type_starts[i];
+		for(int j = 0; j < AT.atoms_count; j++) {
+			const int idx = ts.molecule_starts[AT.atoms_molecule_idx[j]] + AT.atoms_atom_idx[j];
+			ts.type_order[start + j] = idx;
+			ts.type_reference_charge[start + j] = ts.reference_charge[idx];
+		}
 		#undef AT
-		free(molecule_indices);
 	}
 }
 
+/* Copy the atom data into the flat arrays of the training set */
+static void fill_flat_view(void) {
+
+	free_flat_view();
+
+	const int n = ts.atoms_count;
+	ts.molecule_starts = (int *) malloc((ts.molecules_count + 1) * sizeof(int));
+	ts.pos_x = (float *) malloc(n * sizeof(float));
+	ts.pos_y = (float *) malloc(n * sizeof(float));
+	ts.pos_z = (float *) malloc(n * sizeof(float));
+	ts.atom_type_idx = (int *) malloc(n * sizeof(int));
+	ts.reference_charge = (float *) malloc(n * sizeof(float));
+	ts.y = (double *) malloc(n * sizeof(double));
+	ts.type_order = (int *) malloc(n * sizeof(int));
+	ts.type_reference_charge = (float *) malloc(n * sizeof(float));
+	if(!ts.molecule_starts || !ts.pos_x || !ts.pos_y || !ts.pos_z || !ts.atom_type_idx || !ts.reference_charge || !ts.y ||
+	   !ts.type_order || !ts.type_reference_charge)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom data.\n");
+
+	ts.molecule_starts[0] = 0;
+	for(int i = 0; i < ts.molecules_count; i++)
+		ts.molecule_starts[i + 1] = ts.molecule_starts[i] + ts.molecules[i].atoms_count;
+
+	/* Atom type indices and the atom type order are filled by fill_atom_types */
+	#pragma omp parallel for schedule(dynamic)
+	for(int i = 0; i < ts.molecules_count; i++) {
+		const int start = ts.molecule_starts[i];
+		for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
+			#define ATOM ts.molecules[i].atoms[j]
+			ts.pos_x[start + j] = ATOM.position[0];
+			ts.pos_y[start + j] = ATOM.position[1];
+			ts.pos_z[start + j] = ATOM.position[2];
+			ts.reference_charge[start + j] = ATOM.reference_charge;
+			ts.y[start + j] = ATOM.y;
+			#undef ATOM
+		}
+	}
+}
+
+/* Free the flat arrays of the training set */
+static void free_flat_view(void) {
+
+	free(ts.molecule_starts);
+	free(ts.pos_x);
+	free(ts.pos_y);
+	free(ts.pos_z);
+	free(ts.atom_type_idx);
+	free(ts.reference_charge);
+	free(ts.y);
+	free(ts.atom_type_starts);
+	free(ts.type_order);
+	free(ts.type_reference_charge);
+
+	ts.molecule_starts = ts.atom_type_idx = NULL;
+	ts.pos_x = ts.pos_y = ts.pos_z = ts.reference_charge = NULL;
+	ts.y = NULL;
+	ts.atom_type_starts = ts.type_order = NULL;
+	ts.type_reference_charge = NULL;
+}
+
 /* Calculate average electronegativity of a molecule (harmonic mean) */
 static void m_calculate_avg_electronegativity(struct molecule * const m) {
 
@@ -269,17 +432,42 @@ static void m_calculate_charge_stats(struct molecule * const m) {
 /* Calculate y sums for all molecules */
 static void calculate_y(void) {
 
-	for(int i = 0; i < ts.molecules_count; i++)
-		for(int j = 0; j < ts.molecules[i].atoms_count; j++) {
-			#define ATOM(x) ts.molecules[i].atoms[x]
+	for(int i = 0; i < ts.molecules_count; i++) {
+		#define ATOM(x) ts.molecules[i].atoms[x]
+		const int n = ts.molecules[i].atoms_count;
+
+		for(int j = 0; j < n; j++)
 			ATOM(j).y = 0.0;
-			for(int k = 0; k < ts.molecules[i].atoms_count; k++) {
-				if(j == k)
-					continue;
-				ATOM(j).y += ATOM(k).reference_charge * ATOM(j).rdists[k];
+
+		/* Each pair is visited once, walking the arena in order */
+		if(ts.molecules[i].rdists_offset >= 0) {
+			const rdist_t * const rdists = ts.rdists + ts.molecules[i].rdists_offset;
+			for(int k = 1; k < n; k++)
+				for(int j = 0; j < k; j++) {
+					const double rd = rdists[RDIST_IDX(j, k)];
+					ATOM(j).y += ATOM(k).reference_charge * rd;
+					ATOM(k).y += ATOM(j).reference_charge * rd;
+				}
+		} else {
+			float *pos = (float *) malloc(3 * n * sizeof(float));
+			double *column = (double *) malloc(n * sizeof(double));
+			if(!pos || !column)
+				EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for atom distances.\n");
+
+			rd_positions(&ts.molecules[i], pos, pos + n, pos + 2 * n);
+			for(int k = 1; k < n; k++) {
+				rd_column(pos, pos + n, pos + 2 * n, k, 1.0, column);
+				for(int j = 0; j < k; j++) {
+					ATOM(j).y += ATOM(k).reference_charge * column[j];
+					ATOM(k).y += ATOM(j).reference_charge * column[j];
+				}
 			}
-			#undef ATOM
+
+			free(pos);
+			free(column);
 		}
+		#undef ATOM
+	}
 }
 
 /* Find atom type for a particular atom */
@@ -287,33 +475,38 @@ int get_atom_type_idx(const struct atom * const a) {
 
 	assert(a != NULL);
 
-	for(int i = 0; i < ts.atom_types_count; i++)
-		if(at_compare_against_atom(&ts.atom_types[i], a))
-			return i;
+	/* The hash table is valid only once the atom types are filled */
+	if(!ts.atom_types_count)
+		return NOT_FOUND;
 
-	return NOT_FOUND;
+	return at_table[at_table_slot(a)];
 }
 
 /* Do some preprocessing to simplify things later on */
 void preprocess_molecules(void) {
 
-	if(s.mode == MODE_PARAMS || s.mode == MODE_QUALITY) {
+	if(s.mode == MODE_PARAMS || s.mode == MODE_CV || s.mode == MODE_QUALITY) {
 		/* Calculate sum and average of the charges in the molecule */
 		for(int i = 0; i < ts.molecules_count; i++)
 			m_calculate_charge_stats(&ts.molecules[i]);
 	}
 
-	if(s.mode == MODE_PARAMS) {
+	if(s.mode == MODE_PARAMS || s.mode == MODE_CV) {
 		/* Calculate average electronegativies */
 		for(int i = 0; i < ts.molecules_count; i++)
 			m_calculate_avg_electronegativity(&ts.molecules[i]);
 
 		/* Calculate reciprocal distances of atoms for all molecules */
-		for(int i = 0; i < ts.molecules_count; i++)
-			m_calculate_rdists(&ts.molecules[i]);
-
-		/* Calculate auxiliary sum */
-		calculate_y();
+		const int shared = calculate_rdists();
+
+		/* Calculate auxiliary sum; it is shared along with the distances */
+		if(shared)
+			shm_load_y();
+		else {
+			calculate_y();
+			if(s.shm_name[0] != '\0')
+				shm_publish();
+		}
 	}
 
 	/* Finally, fill indices to atoms of a particular kind */
@@ -439,6 +632,42 @@ static int at_compare_against_atom(const struct atom_type * const at, const stru
 	}
 }
 
+/* Hash the properties of the atom which determine its atom type */
+static unsigned int at_hash(const struct atom * const a) {
+
+	assert(a != NULL);
+
+	switch(s.at_customization) {
+		case AT_CUSTOM_ELEMENT:
+			return (unsigned int) a->Z;
+		case AT_CUSTOM_ELEMENT_BOND:
+			return (unsigned int) a->Z * 31u + (unsigned int) a->bond_order;
+		case AT_CUSTOM_USER: {
+			/* FNV-1a over the same characters at_compare_against_atom looks at */
+			unsigned int h = 2166136261u;
+			for(int i = 0; i < 10 && a->type_string[i]; i++)
+				h = (h ^ (unsigned char) a->type_string[i]) * 16777619u;
+			return h;
+		}
+		default:
+			/* Something bad happened */
+			assert(0);
+	}
+}
+
+/* Find the slot of the atom's type in the hash table; it holds NOT_FOUND if
+ * there is no such atom type yet. The table is never more than a quarter full. */
+static int at_table_slot(const struct atom * const a) {
+
+	assert(a != NULL);
+
+	int slot = (int) (at_hash(a) % AT_TABLE_SIZE);
+	while(at_table[slot] != NOT_FOUND && !at_compare_against_atom(&ts.atom_types[at_table[slot]], a))
+		slot = (slot + 1) % AT_TABLE_SIZE;
+
+	return slot;
+}
+
 /* List molecules for which we don't have parameters */
 static void list_molecules_without_parameters(void) {
 
@@ -557,7 +786,7 @@ void discard_invalid_molecules_or_without_charges_or_parameters(void) {
 	if(s.mode == MODE_CHARGES || s.mode == MODE_QUALITY || s.mode == MODE_COVER)
 		list_molecules_without_parameters();
 
-	if(s.mode == MODE_PARAMS || s.mode == MODE_QUALITY)
+	if(s.mode == MODE_PARAMS || s.mode == MODE_CV || s.mode == MODE_QUALITY)
 		list_molecules_without_charges();
 
 	/* Discard those molecules */
@@ -571,7 +800,7 @@ void discard_invalid_molecules_or_without_charges_or_parameters(void) {
 			cond = !ts.molecules[idx].has_parameters || !ts.molecules[idx].is_valid;
 		else if (s.mode == MODE_COVER)
 			cond = !ts.molecules[idx].has_parameters;
-		else if (s.mode == MODE_PARAMS)
+		else if (s.mode == MODE_PARAMS || s.mode == MODE_CV)
 			cond = !ts.molecules[idx].has_charges || !ts.molecules[idx].is_valid;
 		else if (s.mode == MODE_QUALITY)
 			cond = !ts.molecules[idx].has_parameters || !ts.molecules[idx].has_charges || !ts.molecules[idx].is_valid;
@@ -598,6 +827,9 @@ void discard_invalid_molecules_or_without_charges_or_parameters(void) {
 	/* Shrink molecules array */
 	ts.molecules = (struct molecule *) realloc(ts.molecules, sizeof(struct molecule) * ts.molecules_count);
 
+	if((s.mode == MODE_PARAMS || s.mode == MODE_CV) && number_of_discarded)
+		compact_rdists();
+
 	/* We need to rebuild atom types info */
 	for(int i = 0; i < ts.atom_types_count; i++)
 		at_destroy(&ts.atom_types[i]);
@@ -19,6 +19,17 @@
 #ifndef __STRUCTURES_H__
 #define __STRUCTURES_H__
 
+/* Reciprocal distances are stored in single precision unless RDISTS_DOUBLE is defined */
+#ifdef RDISTS_DOUBLE
+typedef double rdist_t;
+#else
+typedef float rdist_t;
+#endif /* RDISTS_DOUBLE */
+
+/* Index of the reciprocal distance of atoms i < j within the molecule's block of
+ * the training set arena; the strict upper triangle is packed by columns */
+#define RDIST_IDX(i, j) ((i) + ((long int) (j) * ((j) - 1)) / 2)
+
 struct atom {
 
 	int Z;				/* atomic number */
@@ -28,7 +39,6 @@ struct atom {
 
 	char type_string[10];
 
-	double *rdists;
 	double y;			/* sum of charges/distance over all atoms in the molecule */
 };
 
@@ -50,6 +60,10 @@ struct molecule {
 	float electronegativity;
 	float average_charge;
 	float sum_of_charges;
+
+	/* Start of the reciprocal distances in ts.rdists; -1 if they are not
+	 * cached and have to be computed on the fly */
+	long int rdists_offset;
 };
 
 void m_destroy(struct molecule * const m);
@@ -84,6 +98,29 @@ struct training_set {
 	struct molecule *molecules;
 	struct atom_type *atom_types;
 
+	/* Reciprocal distances of all molecules, see RDIST_IDX (mode params only) */
+	rdist_t *rdists;
+	long int rdists_count;
+
+	/* Flat copy of the atom data used by the hot loops; atoms of molecule i are
+	 * molecule_starts[i] ... molecule_starts[i + 1] - 1. It is rebuilt whenever
+	 * the set of molecules or atom types changes. */
+	int *molecule_starts;
+	float *pos_x;
+	float *pos_y;
+	float *pos_z;
+	int *atom_type_idx;
+	float *reference_charge;
+	double *y;
+
+	/* The same atoms grouped by atom type; type_order[atom_type_starts[i]] ...
+	 * type_order[atom_type_starts[i + 1] - 1] are the flat indices of atoms of
+	 * type i in the order of atoms_molecule_idx and type_reference_charge holds
+	 * their reference charges in that order */
+	int *atom_type_starts;
+	int *type_order;
+	float *type_reference_charge;
+
 	int atoms_count;
 	int atom_types_count;
 	int molecules_count;
@@ -29,6 +29,11 @@
 extern const struct settings s;
 extern const struct training_set ts;
 
+/* Pool of initialized kappa_data released by the optimizers for reuse */
+static struct kappa_data **kd_pool = NULL;
+static int kd_pool_count = 0;
+static int kd_pool_allocated = 0;
+
 /* Initialize new subset structure from parent */
 void ss_init(struct subset * const ss, const struct subset * const parent) {
 
@@ -36,6 +41,11 @@ void ss_init(struct subset * const ss, const struct subset * const parent) {
 
 	b_init(&ss->molecules, ts.molecules_count);
 	ss->parent = parent;
+	ss->scan_count = 0;
+	ss->scan = NULL;
+	ss->moments = NULL;
+	ss->moments_updates = 0;
+	ss->weights = NULL;
 	if(parent) {
 		b_set_as(&ss->molecules, &parent->molecules);
 	}
@@ -67,11 +77,25 @@ void kd_init(struct kappa_data * const kd) {
 	if(!kd->parameters_alpha || !kd->parameters_beta)
 		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for parameters array.\n");
 
-	kd->charges = (float *) malloc(ts.atoms_count * sizeof(float));
+	kd->per_at_stats = (struct stats *) calloc(ts.atom_types_count, sizeof(struct stats));
+
+	/* With fused statistics, only the best kappa_data gets the charges later on */
+	kd->charges = NULL;
+	kd->per_molecule_stats = NULL;
+	if(!s.fused_stats)
+		kd_alloc_charges(kd);
+}
+
+/* Allocate memory for the charges and per molecule statistics of kappa_data */
+void kd_alloc_charges(struct kappa_data * const kd) {
+
+	assert(kd != NULL);
+
+	/* Zeroed so that an iterative solver has a defined starting point */
+	kd->charges = (float *) calloc(ts.atoms_count, sizeof(float));
 	if(!kd->charges)
 		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for charges array.\n");
 
-	kd->per_at_stats = (struct stats *) calloc(ts.atom_types_count, sizeof(struct stats));
 	kd->per_molecule_stats = (struct stats *) calloc(ts.molecules_count, sizeof(struct stats));
 }
 
@@ -114,6 +138,26 @@ void kd_copy_statistics(struct kappa_data* from, struct kappa_data* to) {
 
 }
 
+/* Copy everything from one kappa_data to another with the same arrays allocated */
+void kd_copy(const struct kappa_data * const from, struct kappa_data * const to) {
+
+	assert(from != NULL);
+	assert(to != NULL);
+
+	to->kappa = from->kappa;
+	to->solver_iterations = from->solver_iterations;
+	to->full_stats = from->full_stats;
+
+	memcpy(to->parameters_alpha, from->parameters_alpha, ts.atom_types_count * sizeof(float));
+	memcpy(to->parameters_beta, from->parameters_beta, ts.atom_types_count * sizeof(float));
+	memcpy(to->per_at_stats, from->per_at_stats, ts.atom_types_count * sizeof(struct stats));
+
+	if(from->charges != NULL)
+		memcpy(to->charges, from->charges, ts.atoms_count * sizeof(float));
+	if(from->per_molecule_stats != NULL)
+		memcpy(to->per_molecule_stats, from->per_molecule_stats, ts.molecules_count * sizeof(struct stats));
+}
+
 /* Destroy contents of the kappa_data structure */
 void kd_destroy(struct kappa_data * const kd) {
 
@@ -126,6 +170,68 @@ void kd_destroy(struct kappa_data * const kd) {
 	free(kd->per_molecule_stats);
 }
 
+/* Get kappa_data from the pool or create new one; only the fields the optimizers
+ * rely on are reset. Can be called from several threads. */
+struct kappa_data *kd_acquire(void) {
+
+	struct kappa_data *kd = NULL;
+
+	#pragma omp critical (kd_pool)
+	{
+		if(kd_pool_count)
+			kd = kd_pool[--kd_pool_count];
+	}
+
+	if(kd == NULL) {
+		kd = (struct kappa_data *) malloc(sizeof(struct kappa_data));
+		if(!kd)
+			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for kappa data.\n");
+		kd_init(kd);
+	} else if(s.eem_solver == SOLVER_MINRES || s.eem_solver == SOLVER_AUTO) {
+		/* Iterative solvers start from the stored charges as from a fresh kappa_data */
+		memset(kd->charges, 0x0, ts.atoms_count * sizeof(float));
+	}
+
+	kd->parent_subset = NULL;
+	kd->kappa = 0.0f;
+	kd->solver_iterations = 0;
+	memset(&kd->full_stats, 0x0, sizeof(struct stats));
+
+	return kd;
+}
+
+/* Return kappa_data obtained by kd_acquire to the pool */
+void kd_release(struct kappa_data * const kd) {
+
+	assert(kd != NULL);
+
+	#pragma omp critical (kd_pool)
+	{
+		if(kd_pool_count == kd_pool_allocated) {
+			kd_pool_allocated = kd_pool_allocated ? 2 * kd_pool_allocated : 16;
+			kd_pool = (struct kappa_data **) realloc(kd_pool, kd_pool_allocated * sizeof(struct kappa_data *));
+			if(!kd_pool)
+				EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for kappa data pool.\n");
+		}
+
+		kd_pool[kd_pool_count++] = kd;
+	}
+}
+
+/* Destroy all kappa_data in the pool */
+void kd_pool_destroy(void) {
+
+	for(int i = 0; i < kd_pool_count; i++) {
+		kd_destroy(kd_pool[i]);
+		free(kd_pool[i]);
+	}
+
+	free(kd_pool);
+	kd_pool = NULL;
+	kd_pool_count = 0;
+	kd_pool_allocated = 0;
+}
+
 /* Destroy contents of the subset */
 void ss_destroy(struct subset * const ss) {
 
@@ -136,6 +242,9 @@ void ss_destroy(struct subset * const ss) {
 
 	b_destroy(&ss->molecules);
 	free(ss->data);
+	free(ss->scan);
+	free(ss->moments);
+	free(ss->weights);
 }
 
 /* Print loaded parameters */
@@ -304,8 +413,11 @@ void kd_print_stats(const struct kappa_data * const kd) {
 	char message[200];
 	memset(message, 0, 200 * sizeof(char));
 
-	snprintf(message, 200, "K: %6.4f |  R: %6.4f  R2: %6.4f  RW: %6.4f  Sp: %6.4f  RMSD: %6.4f  D_avg: %6.4f  D_max: %6.4f\n",
+	snprintf(message, 200, "K: %6.4f |  R: %6.4f  R2: %6.4f  RW: %6.4f  Sp: %6.4f  RMSD: %6.4f  D_avg: %6.4f  D_max: %6.4f",
 		kd->kappa, kd->full_stats.R, kd->full_stats.R2, kd->full_stats.R_w, kd->full_stats.spearman, kd->full_stats.RMSD, kd->full_stats.D_avg, kd->full_stats.D_max);
 
-	printf("%s", message);
+	if(s.eem_solver == SOLVER_MINRES || s.eem_solver == SOLVER_AUTO)
+		printf("%s  Iters: %d\n", message, kd->solver_iterations);
+	else
+		printf("%s\n", message);
 }
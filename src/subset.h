@@ -42,6 +42,9 @@ struct kappa_data {
 
 	float *charges;
 
+	/* Total number of iterations the iterative solver needed for the charges */
+	int solver_iterations;
+
 	float *parameters_alpha;
 	float *parameters_beta;
 
@@ -51,9 +54,14 @@ struct kappa_data {
 };
 
 void kd_init(struct kappa_data * const kd);
+void kd_alloc_charges(struct kappa_data * const kd);
 void kd_copy_parameters(struct kappa_data* from, struct kappa_data* to);
 void kd_copy_statistics(struct kappa_data* from, struct kappa_data* to);
+void kd_copy(const struct kappa_data * const from, struct kappa_data * const to);
 void kd_destroy(struct kappa_data * const kd);
+struct kappa_data *kd_acquire(void);
+void kd_release(struct kappa_data * const kd);
+void kd_pool_destroy(void);
 void kd_print_stats(const struct kappa_data * const kd);
 void kd_print_results(const struct kappa_data * const kd);
 
@@ -63,6 +71,13 @@ int kd_sort_by_is_better(const struct kappa_data * const kd1, const struct kappa
 void kd_sort_by_is_much_better_per_atom(int* results_per_atom, const struct kappa_data * const kd1, const struct kappa_data * const kd2, float threshold);
 int kd_sort_by_is_better_per_atom(const struct kappa_data * const kd1, const struct kappa_data * const kd2, int idx);
 
+/* Total statistics of one point of the full scan */
+struct kappa_stats {
+
+	float kappa;
+	struct stats full_stats;
+};
+
 struct subset {
 
 	struct bit_array molecules;
@@ -73,6 +88,20 @@ struct subset {
 	/* Pointer to the best kappa */
 	struct kappa_data *best;
 
+	/* Statistics of all the points of the full scan; with --scan-keep, data holds
+	 * only the best of them */
+	int scan_count;
+	struct kappa_stats *scan;
+
+	/* Per atom type moments for calculate_parameters, see parameters.h; the number of
+	 * incremental updates they went through since they were calculated from scratch */
+	struct at_moments *moments;
+	int moments_updates;
+
+	/* Multiplicity of each molecule in a bootstrap resample; NULL means every
+	 * enabled molecule counts once */
+	int *weights;
+
 	const struct subset *parent;
 };
 
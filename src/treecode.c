@@ -0,0 +1,298 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "neemp.h"
+#include "treecode.h"
+
+static int build_node(struct treecode * const tc, int first, int count, const double * const cube_center, double half, int depth, int * const tmp);
+
+/* Create node for atoms perm[first] ... perm[first + count - 1] lying in the cube
+ * with the given center and half of the edge length; return index of the node */
+static int build_node(struct treecode * const tc, int first, int count, const double * const cube_center, double half, int depth, int * const tmp) {
+
+	if(tc->nodes_count == tc->nodes_allocated) {
+		tc->nodes_allocated = 2 * tc->nodes_allocated + 1;
+		tc->nodes = (struct tree_node *) realloc(tc->nodes, tc->nodes_allocated * sizeof(struct tree_node));
+		if(!tc->nodes)
+			EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for the octree.\n");
+	}
+
+	const int idx = tc->nodes_count++;
+	#define NODE tc->nodes[idx]
+	#define POS(k, c) tc->pos[3 * (k) + (c)]
+
+	NODE.first = first;
+	NODE.count = count;
+
+	/* Expand around the geometric center of the atoms */
+	for(int c = 0; c < 3; c++) {
+		double sum = 0.0;
+		for(int k = first; k < first + count; k++)
+			sum += POS(k, c);
+		NODE.center[c] = sum / count;
+	}
+
+	double r2 = 0.0;
+	for(int k = first; k < first + count; k++) {
+		double d2 = 0.0;
+		for(int c = 0; c < 3; c++)
+			d2 += (POS(k, c) - NODE.center[c]) * (POS(k, c) - NODE.center[c]);
+		if(d2 > r2)
+			r2 = d2;
+	}
+	NODE.radius = sqrt(r2);
+
+	for(int o = 0; o < 8; o++)
+		NODE.children[o] = -1;
+
+	/* Small molecules get a single leaf, so all their interactions are summed directly */
+	NODE.leaf = count <= TREE_LEAF_SIZE || depth >= TREE_MAX_DEPTH || (depth == 0 && count <= TREECODE_DIRECT_MAX_ATOMS);
+	if(NODE.leaf)
+		return idx;
+
+	/* Sort atoms into octants of the cube */
+	int counts[8] = {0};
+	int *octant = (int *) malloc(count * sizeof(int));
+	if(!octant)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for the octree.\n");
+
+	for(int k = 0; k < count; k++) {
+		int o = 0;
+		for(int c = 0; c < 3; c++)
+			if(POS(first + k, c) >= cube_center[c])
+				o |= 1 << c;
+		octant[k] = o;
+		counts[o]++;
+	}
+
+	int offsets[8];
+	offsets[0] = 0;
+	for(int o = 1; o < 8; o++)
+		offsets[o] = offsets[o - 1] + counts[o - 1];
+
+	int fill[8];
+	memcpy(fill, offsets, 8 * sizeof(int));
+	for(int k = 0; k < count; k++)
+		tmp[fill[octant[k]]++] = first + k;
+	free(octant);
+
+	/* Apply the permutation to both atom indices and positions */
+	int *perm = (int *) malloc(count * sizeof(int));
+	double *pos = (double *) malloc(3 * count * sizeof(double));
+	if(!perm || !pos)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for the octree.\n");
+
+	for(int k = 0; k < count; k++) {
+		perm[k] = tc->perm[tmp[k]];
+		for(int c = 0; c < 3; c++)
+			pos[3 * k + c] = POS(tmp[k], c);
+	}
+
+	memcpy(tc->perm + first, perm, count * sizeof(int));
+	memcpy(tc->pos + 3 * (long int) first, pos, 3 * count * sizeof(double));
+	free(perm);
+	free(pos);
+
+	for(int o = 0; o < 8; o++) {
+		if(!counts[o])
+			continue;
+
+		double child_center[3];
+		for(int c = 0; c < 3; c++)
+			child_center[c] = cube_center[c] + ((o >> c) & 1 ? 0.5 : -0.5) * half;
+
+		const int child = build_node(tc, first + offsets[o], counts[o], child_center, 0.5 * half, depth + 1, tmp);
+		tc->nodes[idx].children[o] = child;
+	}
+
+	#undef POS
+	#undef NODE
+
+	return idx;
+}
+
+/* Build octree over the atoms of the molecule */
+void tc_build(struct treecode * const tc, const struct molecule * const m, float theta) {
+
+	assert(tc != NULL);
+	assert(m != NULL);
+
+	const int n = m->atoms_count;
+
+	tc->atoms_count = n;
+	tc->theta = theta;
+	tc->nodes_count = 0;
+	tc->nodes_allocated = 0;
+	tc->nodes = NULL;
+
+	tc->perm = (int *) malloc(n * sizeof(int));
+	tc->pos = (double *) malloc(3 * n * sizeof(double));
+	int *tmp = (int *) malloc(n * sizeof(int));
+	if(!tc->perm || !tc->pos || !tmp)
+		EXIT_ERROR(MEM_ERROR, "%s", "Cannot allocate memory for the octree.\n");
+
+	double min[3], max[3];
+	for(int c = 0; c < 3; c++)
+		min[c] = max[c] = m->atoms[0].position[c];
+
+	for(int i = 0; i < n; i++) {
+		tc->perm[i] = i;
+		for(int c = 0; c < 3; c++) {
+			tc->pos[3 * i + c] = m->atoms[i].position[c];
+			if(m->atoms[i].position[c] < min[c])
+				min[c] = m->atoms[i].position[c];
+			if(m->atoms[i].position[c] > max[c])
+				max[c] = m->atoms[i].position[c];
+		}
+	}
+
+	double center[3];
+	double half = 0.0;
+	for(int c = 0; c < 3; c++) {
+		center[c] = 0.5 * (min[c] + max[c]);
+		if(0.5 * (max[c] - min[c]) > half)
+			half = 0.5 * (max[c] - min[c]);
+	}
+
+	build_node(tc, 0, n, center, half, 0, tmp);
+
+	free(tmp);
+}
+
+/* Compute phi[i] = sum of x[j] / r_ij over all j != i; interactions with distant
+ * nodes are approximated by their multipole expansion up to the quadrupole */
+void tc_potential(struct treecode * const tc, const double * const x, double * const phi, int nthreads) {
+
+	assert(tc != NULL);
+	assert(x != NULL);
+	assert(phi != NULL);
+
+	/* Upward pass; children are always created after their parent */
+	for(int idx = tc->nodes_count - 1; idx >= 0; idx--) {
+		struct tree_node * const node = &tc->nodes[idx];
+		node->q = 0.0;
+		for(int c = 0; c < 3; c++)
+			node->p[c] = 0.0;
+		for(int c = 0; c < 6; c++)
+			node->m[c] = 0.0;
+
+		if(node->leaf) {
+			for(int k = node->first; k < node->first + node->count; k++) {
+				const double xk = x[tc->perm[k]];
+				double d[3];
+				for(int c = 0; c < 3; c++)
+					d[c] = tc->pos[3 * k + c] - node->center[c];
+
+				node->q += xk;
+				for(int c = 0; c < 3; c++)
+					node->p[c] += xk * d[c];
+
+				node->m[0] += xk * d[0] * d[0];
+				node->m[1] += xk * d[1] * d[1];
+				node->m[2] += xk * d[2] * d[2];
+				node->m[3] += xk * d[0] * d[1];
+				node->m[4] += xk * d[0] * d[2];
+				node->m[5] += xk * d[1] * d[2];
+			}
+		} else {
+			for(int o = 0; o < 8; o++) {
+				if(node->children[o] == -1)
+					continue;
+
+				/* Shift the moments of the child to the center of the node */
+				const struct tree_node * const child = &tc->nodes[node->children[o]];
+				double t[3];
+				for(int c = 0; c < 3; c++)
+					t[c] = child->center[c] - node->center[c];
+
+				node->q += child->q;
+				for(int c = 0; c < 3; c++)
+					node->p[c] += child->p[c] + child->q * t[c];
+
+				node->m[0] += child->m[0] + 2.0 * child->p[0] * t[0] + child->q * t[0] * t[0];
+				node->m[1] += child->m[1] + 2.0 * child->p[1] * t[1] + child->q * t[1] * t[1];
+				node->m[2] += child->m[2] + 2.0 * child->p[2] * t[2] + child->q * t[2] * t[2];
+				node->m[3] += child->m[3] + child->p[0] * t[1] + child->p[1] * t[0] + child->q * t[0] * t[1];
+				node->m[4] += child->m[4] + child->p[0] * t[2] + child->p[2] * t[0] + child->q * t[0] * t[2];
+				node->m[5] += child->m[5] + child->p[1] * t[2] + child->p[2] * t[1] + child->q * t[1] * t[2];
+			}
+		}
+	}
+
+	const double theta2 = (double) tc->theta * tc->theta;
+
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 64)
+	for(int k = 0; k < tc->atoms_count; k++) {
+		const double * const r = tc->pos + 3 * (long int) k;
+		int stack[8 * TREE_MAX_DEPTH + 8];
+		int top = 0;
+		double sum = 0.0;
+
+		stack[top++] = 0;
+		while(top > 0) {
+			const struct tree_node * const node = &tc->nodes[stack[--top]];
+			const double dx = r[0] - node->center[0];
+			const double dy = r[1] - node->center[1];
+			const double dz = r[2] - node->center[2];
+			const double d2 = dx * dx + dy * dy + dz * dz;
+
+			if(node->radius * node->radius < theta2 * d2) {
+				/* Far enough, use the multipole expansion */
+				const double rd = 1.0 / sqrt(d2);
+				const double rd3 = rd * rd * rd;
+				const double * const m = node->m;
+				const double dmd = m[0] * dx * dx + m[1] * dy * dy + m[2] * dz * dz +
+					2.0 * (m[3] * dx * dy + m[4] * dx * dz + m[5] * dy * dz);
+
+				sum += node->q * rd + (node->p[0] * dx + node->p[1] * dy + node->p[2] * dz) * rd3 +
+					0.5 * (3.0 * dmd * rd3 * rd * rd - (m[0] + m[1] + m[2]) * rd3);
+			} else if(node->leaf) {
+				for(int l = node->first; l < node->first + node->count; l++) {
+					if(l == k)
+						continue;
+
+					const double ex = r[0] - tc->pos[3 * l];
+					const double ey = r[1] - tc->pos[3 * l + 1];
+					const double ez = r[2] - tc->pos[3 * l + 2];
+					sum += x[tc->perm[l]] / sqrt(ex * ex + ey * ey + ez * ez);
+				}
+			} else {
+				for(int o = 0; o < 8; o++)
+					if(node->children[o] != -1)
+						stack[top++] = node->children[o];
+			}
+		}
+
+		phi[tc->perm[k]] = sum;
+	}
+}
+
+/* Destroy contents of the treecode */
+void tc_destroy(struct treecode * const tc) {
+
+	assert(tc != NULL);
+
+	free(tc->nodes);
+	free(tc->perm);
+	free(tc->pos);
+}
@@ -0,0 +1,74 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TREECODE_H__
+#define __TREECODE_H__
+
+#include "structures.h"
+
+/* Maximum number of atoms in a leaf of the octree and maximum depth of the tree */
+#define TREE_LEAF_SIZE 16
+#define TREE_MAX_DEPTH 32
+
+/* Molecules up to this size are summed directly; the multipole expansion is the
+ * least accurate for them and the tree does not pay off before about 200 atoms */
+#define TREECODE_DIRECT_MAX_ATOMS 128
+
+/* GMRES restart used with the treecode */
+#define TREECODE_GMRES_RESTART 30
+
+/* Molecules up to this size are checked against the dense solver in verbose mode */
+#define TREECODE_CHECK_MAX_ATOMS 3000
+
+struct tree_node {
+
+	/* Expansion center and radius of the sphere containing all the atoms */
+	double center[3];
+	double radius;
+
+	/* Atoms perm[first] ... perm[first + count - 1] belong to the node */
+	int first;
+	int count;
+
+	int children[8];
+	int leaf;
+
+	/* Monopole, dipole and quadrupole (xx, yy, zz, xy, xz, yz) moments for the current charges */
+	double q;
+	double p[3];
+	double m[6];
+};
+
+struct treecode {
+
+	int atoms_count;
+	float theta;
+
+	int nodes_count;
+	int nodes_allocated;
+	struct tree_node *nodes;
+
+	int *perm;
+	double *pos;
+};
+
+void tc_build(struct treecode * const tc, const struct molecule * const m, float theta);
+void tc_potential(struct treecode * const tc, const double * const x, double * const phi, int nthreads);
+void tc_destroy(struct treecode * const tc);
+
+#endif /* __TREECODE_H__ */
@@ -0,0 +1,101 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "tuning.h"
+
+/* Return the band of systems of size n */
+int tuning_band(int n) {
+
+	for(int k = 0; k < TUNING_BANDS_COUNT - 1; k++)
+		if(n <= tuning_band_size(k))
+			return k;
+
+	return TUNING_BANDS_COUNT - 1;
+}
+
+/* Return the largest system size of the band */
+int tuning_band_size(int band) {
+
+	assert(band >= 0 && band < TUNING_BANDS_COUNT);
+
+	return TUNING_MIN_SIZE << band;
+}
+
+/* Load the tuning table from the file. Return 0 if it holds a backend for
+ * every band, 1 otherwise. */
+int tt_load(struct tuning_table * const tt, const char * const file) {
+
+	assert(tt != NULL);
+	assert(file != NULL);
+
+	FILE * const f = fopen(file, "r");
+	if(!f)
+		return 1;
+
+	int found[TUNING_BANDS_COUNT];
+	memset(found, 0, TUNING_BANDS_COUNT * sizeof(int));
+
+	char line[MAX_LINE_LEN];
+	while(fgets(line, MAX_LINE_LEN, f)) {
+		if(line[0] == '#')
+			continue;
+
+		int size;
+		char name[TUNING_NAME_LEN];
+		if(sscanf(line, "%d %15s", &size, name) != 2)
+			continue;
+
+		for(int k = 0; k < TUNING_BANDS_COUNT; k++)
+			if(size == tuning_band_size(k)) {
+				strcpy(tt->backends[k], name);
+				found[k] = 1;
+			}
+	}
+
+	fclose(f);
+
+	for(int k = 0; k < TUNING_BANDS_COUNT; k++)
+		if(!found[k])
+			return 1;
+
+	return 0;
+}
+
+/* Store the tuning table to the file. Return 0 on success. */
+int tt_save(const struct tuning_table * const tt, const char * const file) {
+
+	assert(tt != NULL);
+	assert(file != NULL);
+
+	FILE * const f = fopen(file, "w");
+	if(!f)
+		return 1;
+
+	fprintf(f, "# NEEMP solver tuning table: largest system size, fastest backend\n");
+	for(int k = 0; k < TUNING_BANDS_COUNT; k++)
+		fprintf(f, "%d %s\n", tuning_band_size(k), tt->backends[k]);
+
+	fclose(f);
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+/* Copyright 2013-2016 Tomas Racek (tom@krab1k.net)
+ *
+ * This file is part of NEEMP.
+ *
+ * NEEMP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NEEMP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with NEEMP. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TUNING_H__
+#define __TUNING_H__
+
+/* Systems are divided into bands by size; band k holds the sizes up to
+ * TUNING_MIN_SIZE << k, the last band holds all the larger ones as well */
+#define TUNING_BANDS_COUNT 8
+#define TUNING_MIN_SIZE 16
+
+#define TUNING_NAME_LEN 16
+
+/* Each backend is run repeatedly for at least this time (in seconds) */
+#define TUNING_MIN_TIME 0.05
+
+/* Default tuning file, placed in the home directory */
+#define TUNING_FILE_NAME ".neemp_tuning"
+
+/* The fastest solver backend for each band of system sizes */
+struct tuning_table {
+
+	char backends[TUNING_BANDS_COUNT][TUNING_NAME_LEN];
+};
+
+int tuning_band(int n);
+int tuning_band_size(int band);
+int tt_load(struct tuning_table * const tt, const char * const file);
+int tt_save(const struct tuning_table * const tt, const char * const file);
+
+#endif /* __TUNING_H__ */